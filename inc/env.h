@@ -43,6 +43,47 @@ enum EnvType {
 	ENV_TYPE_USER = 0,
 };
 
+// A region [vi_start, vi_end) of an env's address space that may have
+// pages mapped in it, as returned by sys_vma_list.  Pages outside all
+// regions are never mapped.
+struct VmaInfo {
+	uintptr_t vi_start;
+	uintptr_t vi_end;
+	int vi_advice;		// MADV_*, as given to sys_madvise
+};
+
+// One page operation for sys_page_ops: po_op is PAGEOP_ALLOC,
+// PAGEOP_MAP or PAGEOP_UNMAP, and the other fields are the arguments of
+// sys_page_alloc (env, va, perm), sys_page_map (all of them) or
+// sys_page_unmap (env, va).  The kernel stores the outcome in po_result.
+enum {
+	PAGEOP_ALLOC = 0,
+	PAGEOP_MAP,
+	PAGEOP_UNMAP,
+};
+
+// Most operations one sys_page_ops call takes
+#define PAGEOP_MAX		1024
+
+struct PageOp {
+	int po_op;
+	envid_t po_env;
+	void *po_va;
+	envid_t po_dstenv;		// PAGEOP_MAP only
+	void *po_dstva;			// PAGEOP_MAP only
+	int po_perm;			// Not for PAGEOP_UNMAP
+	int po_result;			// 0 or < 0 error, set by the kernel
+};
+
+// How an env means to use a range of its memory, for sys_madvise.
+enum {
+	MADV_NORMAL = 0,	// No particular way
+	MADV_SEQUENTIAL,	// In order: fault in pages ahead of each fault
+	MADV_WILLNEED,		// Soon: fault it all in now, and have
+				// sys_page_alloc allocate at once
+	MADV_DONTNEED,		// No more: unmap it all
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -53,8 +94,17 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling (see kern/sched.c)
+	struct Env *env_rq_next;	// Next env on the same run queue
+	struct Env *env_rq_prev;	// Previous env on the same run queue
+	int env_rq_cpu;			// Run queue this env is on, or -1
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	struct EnvSegment *env_segs;	// Program segments paged in on demand
+	int env_nsegs;			// Number of entries in env_segs
+	struct Vma *env_vmas;		// Regions that may be mapped, sorted
+	int env_nvmas;			// Number of regions on env_vmas
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
@@ -25,10 +25,14 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
+// Our Env.  Threads made by sfork share all memory but their stacks,
+// so the pointer is kept in the top word of the stack (UTHISENV), which
+// every env's stack starts below.
+#define thisenv		(*(const volatile struct Env **) UTHISENV)
+
 // exit.c
 void	exit(void);
 
@@ -53,6 +57,11 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+unsigned int sys_time_msec(void);
+int	sys_vma_list(envid_t env, uintptr_t from, struct VmaInfo *buf, int n);
+envid_t	sys_fork(void);
+int	sys_page_ops(struct PageOp *ops, int n);
+int	sys_madvise(envid_t env, void *va, size_t len, int advice);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -73,9 +82,9 @@ int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	ufork(void);
+envid_t	sfork(void);
 
 
 
@@ -23,6 +23,10 @@
  *                                                    kernel/user
  *
  *    4 Gig -------->  +------------------------------+
+ *                     |     Kernel kmap windows      | RW/--  PTSIZE
+ *    KMAPBASE ----->  +------------------------------+ 0xffc00000
+ *                     |   Kernel vmalloc mappings    | RW/--  8*PTSIZE
+ *    VMALLOCBASE -->  +------------------------------+ 0xfdc00000
  *                     |                              | RW/--
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  *                     :              .               :
@@ -83,9 +87,20 @@
  */
 
 
-// All physical memory mapped at this address
+// Physical memory mapped at this address, up to VMALLOCBASE - KERNBASE
+// (220MB).  Memory above that is "high memory", which the kernel maps
+// a page at a time into the windows at KMAPBASE (see kmap).
 #define	KERNBASE	0xF0000000
 
+// Virtually contiguous kernel buffers and their guard pages (see
+// kern/vmalloc.c).
+#define VMALLOCBASE	0xFDC00000
+#define KMAPBASE	0xFFC00000
+
+// entry_pgdir maps this much physical memory at KERNBASE: the kernel
+// and whatever boot_alloc hands out must fit in it.
+#define EARLYMEM	(8 * PTSIZE)
+
 // At IOPHYSMEM (640K) there is a 384K hole for I/O.  From the kernel,
 // IOPHYSMEM can be addressed at KERNBASE + IOPHYSMEM.  The hole ends
 // at physical address EXTPHYSMEM.
@@ -126,6 +141,9 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// Its top word holds the env's Env pointer (thisenv, see inc/lib.h); the
+// stack proper, arguments and all, starts below it.
+#define UTHISENV	(USTACKTOP - 4)
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -176,16 +194,29 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
-	struct PageInfo *pp_link;
-
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
 	// Pages allocated at boot time using pmap.c's
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// If PP_FREE is set, this page heads a free block of
+	// 2^pp_order pages.
+	uint8_t pp_order;
+	uint8_t pp_flags;
+
+	// That is all: struct PageInfo is kept to the fields that are
+	// looked at most (and that user programs read through UPAGES), so
+	// that a cache line covers 16 pages.  The kernel keeps the rest of
+	// the metadata in arrays of its own; see kern/pmap.h.
 };
 
+#define PP_FREE		0x01	// Page heads a block on a free list
+#define PP_SLAB		0x02	// Page is a kmem cache slab (kern/kmalloc.c)
+#define PP_KMALLOC	0x04	// Page heads a large kmalloc block
+#define PP_KSM		0x08	// Page is shared by kern/ksm.c
+#define PP_ZRAM		0x10	// Page holds compressed pages (kern/zram.c)
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -69,12 +69,30 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+// The kernel sets it too, on mappings of the shared zero page.
+#define PTE_COW		0x800
+
+// PTE_SHARE marks pages that fork shares writable with the child
+// instead of copy-on-write.
+#define PTE_SHARE	0x400
+
+// PTE_SWAP marks an entry that is not present because the kernel has
+// compressed the page away (kern/zram.c); the upper 20 bits then name
+// the compressed copy.  The first access brings the page back.  It is
+// only meaningful when PTE_P is clear.
+#define PTE_SWAP	0x200
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// Address of the 4MB page mapped by a large (PTE_PS) page directory entry
+#define PDE_LARGE_ADDR(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -89,6 +107,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -96,6 +115,25 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID leaf 1 feature flags (%edx)
+#define CPUID_FEAT_PSE	0x00000008	// Page Size Extensions
+#define CPUID_FEAT_PGE	0x00002000	// Page Global Enable
+#define CPUID_FEAT_PAT	0x00010000	// Page Attribute Table
+
+// Page Attribute Table MSR, and the memory types it can hold
+#define MSR_PAT		0x277
+#define PAT_UC		0x00		// Uncacheable
+#define PAT_WC		0x01		// Write-combining
+#define PAT_WT		0x04		// Write-through
+#define PAT_WB		0x06		// Write-back
+#define PAT_UCMINUS	0x07		// Uncacheable, unless MTRRs say WC
+
+// PAT MSR value with entries 0-3, which PTE_PWT and PTE_PCD select, set
+// to a, b, c and d, and entries 4-7 (the PTE_PAT bit, unused) the same.
+#define PAT_ENTRIES(a, b, c, d) \
+	((((uint64_t) (d) << 24) | ((c) << 16) | ((b) << 8) | (a)) \
+	 * 0x100000001ULL)
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
@@ -16,6 +16,11 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_time_msec,
+	SYS_vma_list,
+	SYS_fork,
+	SYS_page_ops,
+	SYS_madvise,
 	NSYSCALLS
 };
 
@@ -14,12 +14,33 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/kmalloc.h>
+#include <kern/zram.h>
+#include <kern/vma.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// Cache of the read-only pages of program images, so that all the envs
+// created from one binary share a single copy of its text.  A page is
+// found by the binary's start address and its virtual address.  The
+// cache holds a reference to every page in it and never lets go: the
+// binaries are part of the kernel and live as long as it does.
+struct ImagePage {
+	const uint8_t *ip_binary;	// _binary_obj_*_start of the program
+	uintptr_t ip_va;		// Address of the page in the program
+	struct PageInfo *ip_page;
+	struct ImagePage *ip_next;	// Next in the same hash bucket
+};
+#define IMAGE_HASH_SIZE	64
+#define IMAGE_HASH(binary, va) \
+	((((uintptr_t) (binary) >> 4) ^ ((va) >> PGSHIFT)) % IMAGE_HASH_SIZE)
+static struct ImagePage *image_hash[IMAGE_HASH_SIZE];
+static struct KmemCache *image_page_cache;
+
 #define ENVGENSHIFT	12		// >= LOGNENV
+#define ENV_FAULT_AROUND 16		// Pages faulted in after a sequential fault
 
 // Global descriptor table.
 //
@@ -108,6 +129,55 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Look at up to 'nptes' more page table entries of the user memory of
+// all envs, going on from where 'sc' left off, and call sc->sc_pte on
+// each present one until it returns nonzero.  For background scanners
+// (kern/ksm.c, kern/zram.c).  Skipped are envs that are free or dying
+// or that sc->sc_skip (if any) picks, large pages, and page tables
+// shared by fork (see pgtable_share).  sc->sc_pass (if any) is called
+// each time the scan is done with the last env and starts over.
+//
+// Returns the last value sc->sc_pte returned, or 0.
+//
+int
+env_scan(struct EnvScan *sc, int nptes, void *arg)
+{
+	struct Env *e;
+	uintptr_t va;
+	pde_t pde;
+	pte_t *pte;
+	int n, r = 0;
+
+	for (n = 0; n < nptes && !r; n++) {
+		if (sc->sc_envx == NENV) {
+			if (sc->sc_pass)
+				sc->sc_pass();
+			sc->sc_envx = 0;
+			sc->sc_va = 0;
+		}
+		e = &envs[sc->sc_envx];
+		if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+		    || !e->env_pgdir || sc->sc_va >= UTOP
+		    || (sc->sc_skip && sc->sc_skip(e))) {
+			sc->sc_envx++;
+			sc->sc_va = 0;
+			continue;
+		}
+		pde = e->env_pgdir[PDX(sc->sc_va)];
+		if (!(pde & PTE_P) || (pde & PTE_PS) || !(pde & PTE_W)) {
+			sc->sc_va = ROUNDDOWN(sc->sc_va, PTSIZE) + PTSIZE;
+			continue;
+		}
+		va = sc->sc_va;
+		sc->sc_va += PGSIZE;
+		pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+		if (*pte & PTE_P)
+			r = sc->sc_pte(e, va, pte, arg);
+	}
+	return r;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -126,6 +196,7 @@ env_init(void)
 		envs[i].env_id = 0;
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_type = ENV_TYPE_USER;
+		envs[i].env_rq_cpu = -1;
 		if (i==0) {
 			continue;
 		}
@@ -145,6 +216,8 @@ env_init(void)
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
+
+	check_vma();
 }
 
 // Load GDT and segment descriptors.
@@ -211,6 +284,8 @@ env_setup_vm(struct Env *e)
 	 * End		- last entry of kern_pgdir (has NPDENTRIES entries)
 	 */
 	p->pp_ref++;
+	PP_NPTES(p) = 0;
+	PP_ENV(p) = e;
 	e->env_pgdir = page2kva(p);
 	memset(e->env_pgdir,0,PGSIZE);
 	for(i=PDX(UTOP);i<NPDENTRIES;++i){
@@ -274,7 +349,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_tf.tf_ds = GD_UD | 3;
 	e->env_tf.tf_es = GD_UD | 3;
 	e->env_tf.tf_ss = GD_UD | 3;
-	e->env_tf.tf_esp = USTACKTOP;
+	e->env_tf.tf_esp = UTHISENV;
 	e->env_tf.tf_cs = GD_UT | 3;
 	// You will set e->env_tf.tf_eip later.
 
@@ -288,9 +363,16 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// No program image yet.
+	e->env_segs = NULL;
+	e->env_nsegs = 0;
+	e->env_vmas = NULL;
+	e->env_nvmas = 0;
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
+	sched_enqueue(e);
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
@@ -320,9 +402,12 @@ region_alloc(struct Env *e, void *va, size_t len)
 	uintptr_t va_start_of_region = ROUNDDOWN((uintptr_t)va,PGSIZE);
 	uintptr_t va_end_of_region = ROUNDUP((uintptr_t)(va)+len,PGSIZE);
 	uintptr_t va_pages_iterator = va_start_of_region;
+	if (vma_add(e, va_start_of_region, va_end_of_region) < 0) {
+		panic("Out of memory for the region list");
+	}
 	for(;va_pages_iterator<va_end_of_region;va_pages_iterator += PGSIZE){
 		struct PageInfo* p_physical_page_descriptor;
-		if(!(p_physical_page_descriptor=page_alloc(ALLOC_ZERO))){
+		if(!(p_physical_page_descriptor=page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM))){
 			panic("Out of free memory");
 		}
 		if(page_insert(	e->env_pgdir,
@@ -395,23 +480,48 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	struct Proghdr * ph  =
 			(struct Proghdr *) ((uint8_t *) elf_header + elf_header->e_phoff);
 	struct Proghdr  * eph = ph + elf_header->e_phnum;
-	//  Loading the segments is much simpler if you can move data
-	//  directly into the virtual addresses stored in the ELF binary.
-	//  So which page directory should be in force during
-	//  this function?
-	//Set CR3 register to user environment
-	lcr3(PADDR(e->env_pgdir));
+	struct EnvSegment * es;
+	//  Nothing is copied here: the segments are only recorded, and
+	//  env_demand_page fills each page from 'binary' the first time
+	//  the environment touches it.  So creating an env costs time
+	//  and memory for the pages it uses, not for the whole binary.
+	//  Segments without ELF_PROG_FLAG_WRITE are mapped read-only,
+	//  and their pages are shared by every env running 'binary'.
+	e->env_nsegs = 0;
 	for (; ph < eph; ph++) {
+		if (ph->p_type == ELF_PROG_LOAD) {
+			e->env_nsegs++;
+		}
+	}
+	if (e->env_nsegs && !(e->env_segs = kmalloc(e->env_nsegs * sizeof(*es)))) {
+		panic("Out of memory for the program segments");
+	}
+	es = e->env_segs;
+	for (ph = (struct Proghdr *) ((uint8_t *) elf_header + elf_header->e_phoff);
+	     ph < eph; ph++) {
 		if (ph->p_type != ELF_PROG_LOAD) {
 			continue;
 		}
 		if(ph->p_filesz > ph->p_memsz){
 			panic("The file size is greater than memory.");
 		}
-		region_alloc(e,(void *)ph->p_va,ph->p_memsz);
-		memset((void *)ph->p_va,0,ph->p_memsz);
-		// Like memcpy but handles source and target overlapping
-		memmove((void *)ph->p_va,binary + ph->p_offset,ph->p_filesz);
+		if (ph->p_va + ph->p_memsz > UTOP || ph->p_va + ph->p_memsz < ph->p_va
+		    || ph->p_offset + ph->p_filesz > size) {
+			panic("Segment out of bounds");
+		}
+		es->es_binary = binary;
+		es->es_va = ph->p_va;
+		es->es_memsz = ph->p_memsz;
+		es->es_data = binary + ph->p_offset;
+		es->es_filesz = ph->p_filesz;
+		es->es_perm = PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE) {
+			es->es_perm |= PTE_W;
+		}
+		if (ph->p_memsz && vma_add(e, ph->p_va, ph->p_va + ph->p_memsz) < 0) {
+			panic("Out of memory for the region list");
+		}
+		es++;
 	}
 	//Entry point - first instruction to run:
 	//set eip register to hold an address of the instruction,
@@ -425,9 +535,235 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 
 	// LAB 3: Your code here.
 	region_alloc(e, (void *) (USTACKTOP - PGSIZE), PGSIZE);
+}
 
-	//Return back to Kernel space
-	lcr3(PADDR(kern_pgdir));
+// Find the cached read-only page at 'va' of 'binary'.
+static struct PageInfo *
+image_page_lookup(const uint8_t *binary, uintptr_t va)
+{
+	struct ImagePage *ip;
+
+	for (ip = image_hash[IMAGE_HASH(binary, va)]; ip; ip = ip->ip_next)
+		if (ip->ip_binary == binary && ip->ip_va == va)
+			return ip->ip_page;
+	return NULL;
+}
+
+// Add 'pp' to the cache as the page at 'va' of 'binary'.  If there is
+// no memory for the entry the page simply stays private.
+static void
+image_page_insert(const uint8_t *binary, uintptr_t va, struct PageInfo *pp)
+{
+	struct ImagePage *ip;
+	unsigned h = IMAGE_HASH(binary, va);
+
+	if (!image_page_cache)
+		image_page_cache = kmem_cache_create("image_page",
+						     sizeof(struct ImagePage),
+						     0, NULL);
+	if (!image_page_cache || !(ip = kmem_cache_alloc(image_page_cache)))
+		return;
+	ip->ip_binary = binary;
+	ip->ip_va = va;
+	ip->ip_page = pp;
+	pp->pp_ref++;
+	ip->ip_next = image_hash[h];
+	image_hash[h] = ip;
+}
+
+//
+// Fill in the page at 'va' of 'e's program image, if 'va' lies in one
+// of its segments and nothing is mapped there yet: copy the segment's
+// initialized bytes from the binary and leave the rest (bss) zero.
+// A page that only read-only segments cover is mapped read-only and
+// taken from (or added to) the cache shared by all instances of the
+// binary.  A page with no file data in it (bss) maps the zero page,
+// unless the env is about to 'write' it.  A page that was compressed
+// away (kern/zram.c) is brought back, image or not.
+//
+// Returns 0 if a page is mapped at 'va' on return, -E_FAULT if 'va'
+// is not part of the program image, -E_NO_MEM if out of memory.
+//
+int
+env_demand_page(struct Env *e, uintptr_t va, bool write)
+{
+	struct EnvSegment *es;
+	struct PageInfo *pp;
+	uintptr_t start, end;
+	uint8_t *kva;
+	bool found = 0, covered = 0, nodata = 1;
+	int i, r, perm = PTE_U;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (va >= UTOP)
+		return -E_FAULT;
+	if (page_lookup(e->env_pgdir, (void *) va, NULL))
+		return 0;
+	if ((r = zram_swap_in(e->env_pgdir, va)) != 0)
+		return r < 0 ? r : 0;
+	if (!e->env_nsegs)
+		return -E_FAULT;
+
+	for (i = 0; i < e->env_nsegs; i++) {
+		es = &e->env_segs[i];
+		if (va + PGSIZE <= es->es_va || va >= es->es_va + es->es_memsz)
+			continue;
+		found = 1;
+		perm |= es->es_perm;
+		if (es->es_va <= va && va + PGSIZE <= es->es_va + es->es_filesz)
+			covered = 1;
+		if (es->es_filesz && va < es->es_va + es->es_filesz)
+			nodata = 0;
+	}
+	if (!found)
+		return -E_FAULT;
+
+	if (nodata && (!write || !(perm & PTE_W)))
+		return page_insert(e->env_pgdir, zero_page, (void *) va,
+				   ZERO_PAGE_PERM(perm));
+
+	es = &e->env_segs[0];
+	if (!(perm & PTE_W) && (pp = image_page_lookup(es->es_binary, va)))
+		return page_insert(e->env_pgdir, pp, (void *) va, perm);
+
+	// A page wholly inside a segment's file data needs no zeroing.
+	if (!(pp = page_alloc(ALLOC_HIGHMEM | (covered ? 0 : ALLOC_ZERO))))
+		return -E_NO_MEM;
+	kva = kmap(pp);
+	for (i = 0; i < e->env_nsegs; i++) {
+		es = &e->env_segs[i];
+		start = MAX(va, es->es_va);
+		end = MIN(va + PGSIZE, es->es_va + es->es_filesz);
+		if (start < end)
+			memcpy(kva + (start - va),
+			       es->es_data + (start - es->es_va), end - start);
+	}
+	kunmap(kva);
+	if (!(perm & PTE_W))
+		image_page_insert(e->env_segs[0].es_binary, va, pp);
+	if (page_insert(e->env_pgdir, pp, (void *) va, perm) < 0) {
+		if (!pp->pp_ref)
+			page_free(pp);
+		return -E_NO_MEM;
+	}
+	return 0;
+}
+
+//
+// Fault in ahead of time the pages of [start, end) that lie in one of
+// 'e's regions: page in whatever is not present (the program image,
+// compressed pages), and if 'write', give each page that maps the zero
+// page a page of its own.  Pages shared with other envs are left
+// copy-on-write.  For sys_madvise and fault-around.
+//
+// Returns 0, or -E_NO_MEM if it ran out of memory on the way.
+//
+int
+env_prefault(struct Env *e, uintptr_t start, uintptr_t end, bool write)
+{
+	struct Vma *v;
+	uintptr_t va;
+	pte_t *pte;
+	int r;
+
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	for (v = e->env_vmas; v && v->vm_start < end; v = v->vm_next) {
+		for (va = MAX(start, v->vm_start); va < MIN(end, v->vm_end);
+		     va += PGSIZE) {
+			pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+			if ((!pte || !(*pte & PTE_P))
+			    && env_demand_page(e, va, write) == -E_NO_MEM)
+				return -E_NO_MEM;
+			if (!write)
+				continue;
+			pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+			if (pte && (*pte & (PTE_P | PTE_COW)) == (PTE_P | PTE_COW)
+			    && pa2page(PTE_ADDR(*pte)) == zero_page
+			    && (r = page_unshare(e->env_pgdir, (void *) va)) < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+//
+// 'e' just took a page fault at 'va', which is resolved.  If the region
+// holds memory that 'e' goes through in order (MADV_SEQUENTIAL), fault
+// in the next few pages too, so that it takes one fault for every
+// ENV_FAULT_AROUND pages instead of one for every page.
+//
+void
+env_fault_around(struct Env *e, uintptr_t va, bool write)
+{
+	struct Vma *v = vma_lookup(e, va);
+
+	if (!v || v->vm_advice != MADV_SEQUENTIAL)
+		return;
+	va = ROUNDDOWN(va, PGSIZE) + PGSIZE;
+	// Only a hint: running out of memory is not an error.
+	env_prefault(e, va, MIN(v->vm_end, va + ENV_FAULT_AROUND * PGSIZE),
+		     write);
+}
+
+//
+// Give 'dst' a copy-on-write copy of the address space of 'src' below
+// UTOP, for sys_fork.  The page tables of 'src' are shared with 'dst'
+// read-only (see pgtable_share), and copied along with the pages they
+// map once either env writes through them.  Only the regions of 'src'
+// are looked at.  'src' must be curenv.
+//
+// Returns 0 on success, -E_NO_MEM if out of memory.  On failure 'dst'
+// holds part of the address space; the caller frees it.
+//
+int
+env_copy_vm(struct Env *dst, struct Env *src)
+{
+	struct Vma *v;
+	uint32_t pdeno;
+	int r = 0;
+
+	assert(src == curenv);
+	for (v = src->env_vmas; v && r == 0; v = v->vm_next) {
+		if ((r = vma_add(dst, v->vm_start, v->vm_end)) < 0)
+			break;
+		// Neighbouring regions may share a page table.
+		for (pdeno = PDX(v->vm_start); pdeno <= PDX(v->vm_end - 1); pdeno++)
+			if (!(dst->env_pgdir[pdeno] & PTE_P)
+			    && (r = pgtable_share(dst->env_pgdir, src->env_pgdir,
+						  (uintptr_t) PGADDR(pdeno, 0, 0))) < 0)
+				break;
+	}
+	// Writes through the old, writable page directory entries of
+	// 'src' may still be cached.
+	lcr3(PADDR(src->env_pgdir));
+	return r;
+}
+
+//
+// Give 'dst' the program image of 'src', for sys_exofork: the pages
+// 'src' has not touched yet are filled in for 'dst' on demand too.
+//
+int
+env_copy_segments(struct Env *dst, struct Env *src)
+{
+	struct EnvSegment *es;
+	int i;
+
+	if (!src->env_nsegs)
+		return 0;
+	if (!(dst->env_segs = kmalloc(src->env_nsegs * sizeof(struct EnvSegment))))
+		return -E_NO_MEM;
+	memcpy(dst->env_segs, src->env_segs,
+	       src->env_nsegs * sizeof(struct EnvSegment));
+	dst->env_nsegs = src->env_nsegs;
+	for (i = 0; i < dst->env_nsegs; i++) {
+		es = &dst->env_segs[i];
+		if (es->es_memsz
+		    && vma_add(dst, es->es_va, es->es_va + es->es_memsz) < 0)
+			return -E_NO_MEM;
+	}
+	return 0;
 }
 
 //
@@ -455,54 +791,91 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
 	
 }
 
+//
+// Unmap all pages of 'e' in the page table at 'pdeno', if there is one,
+// and free the page table.
+//
+static void
+env_free_pgtable(struct Env *e, uint32_t pdeno)
+{
+	pte_t *pt;
+	uint32_t pteno;
+	physaddr_t pa;
+
+	// only look at mapped page tables; one shared with another env
+	// is left to that env
+	if (!(e->env_pgdir[pdeno] & PTE_P)
+	    || pgtable_drop(e->env_pgdir, (uintptr_t) PGADDR(pdeno, 0, 0)))
+		return;
+
+	// find the pa and va of the page table
+	pa = PTE_ADDR(e->env_pgdir[pdeno]);
+	pt = (pte_t*) KADDR(pa);
+
+	// unmap all PTEs in this page table; page_remove frees
+	// the page table along with its last mapping
+	for (pteno = 0; pteno <= PTX(~0); pteno++) {
+		if (!(e->env_pgdir[pdeno] & PTE_P))
+			return;
+		if (pt[pteno] & (PTE_P | PTE_SWAP))
+			page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+	}
+
+	// free the page table itself if it had no mappings
+	e->env_pgdir[pdeno] = 0;
+	PP_NPTES(pa2page(PADDR(e->env_pgdir)))--;
+	page_decref(pa2page(pa));
+}
+
 //
 // Frees env e and all memory it uses.
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
+	struct Vma *v;
+	uint32_t pdeno;
 	physaddr_t pa;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv) {
+		thiscpu->cpu_pgdir = kern_pgdir;
 		lcr3(PADDR(kern_pgdir));
+	}
 
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address
+	// space.  Only the env's regions can have any.
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
-	}
+	tlb_batch_begin();
+	for (v = e->env_vmas; v; v = v->vm_next)
+		for (pdeno = PDX(v->vm_start); pdeno <= PDX(v->vm_end - 1); pdeno++)
+			env_free_pgtable(e, pdeno);
+	// A page table left over means a mapping was made without its
+	// region; sweep the whole address space rather than leak it.
+	if (PP_NPTES(pa2page(PADDR(e->env_pgdir))))
+		for (pdeno = 0; pdeno < PDX(UTOP); pdeno++)
+			env_free_pgtable(e, pdeno);
+	tlb_batch_end();
+	vma_free_all(e);
+
+	// forget the program image
+	kfree(e->env_segs);
+	e->env_segs = NULL;
+	e->env_nsegs = 0;
 
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
+	PP_ENV(pa2page(pa)) = NULL;
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
+	sched_dequeue(e);
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
@@ -543,7 +916,9 @@ void
 env_pop_tf(struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
+	// (there is no curenv when a TLB shootdown interrupts sched_halt)
+	if (curenv)
+		curenv->env_cpunum = cpunum();
 
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
@@ -584,18 +959,29 @@ env_run(struct Env *e)
 	// LAB 3: Your code here.
 
 	//Step 1
-	// Not the first time - some environment is running
-	if (curenv&& curenv->env_status == ENV_RUNNING) {
+	// Not the first time - some environment is running.
+	// The env we switch away from goes to the tail of this CPU's
+	// run queue; the one we switch to must not stay on any queue.
+	if (curenv && curenv != e && (curenv->env_status == ENV_RUNNING
+				      || curenv->env_status == ENV_RUNNABLE)) {
 		curenv->env_status = ENV_RUNNABLE;
+		sched_enqueue(curenv);
 	}
+	sched_dequeue(e);
 	curenv = e;
 	curenv->env_status = ENV_RUNNING;
 	++curenv->env_runs;
+	// Tell tlb_invalidate which address space this CPU is about to
+	// use, while we still hold the lock.
+	thiscpu->cpu_pgdir = curenv->env_pgdir;
 
 	//lab4 start - release the lock right before switching to user mode
 	unlock_kernel();
 	//lab4 end
-	lcr3(PADDR(curenv->env_pgdir));
+	// Reloading cr3 flushes the TLB; don't when we are returning to
+	// the env whose page directory is already loaded.
+	if (rcr3() != PADDR(curenv->env_pgdir))
+		lcr3(PADDR(curenv->env_pgdir));
 
 	//Step 2
 	// Use env_pop_tf() to restore the environment's registers
@@ -6,6 +6,28 @@
 #include <inc/env.h>
 #include <kern/cpu.h>
 
+// A loadable segment of an env's program binary.  load_icode only
+// records the segments; env_demand_page fills a page of one from the
+// kernel's copy of the binary the first time the env touches it.
+struct EnvSegment {
+	const uint8_t *es_binary;	// The binary (_binary_obj_*_start)
+	uintptr_t es_va;		// Where the segment starts in memory
+	size_t es_memsz;		// Its size in memory
+	const uint8_t *es_data;		// Its initialized part in the binary
+	size_t es_filesz;		// Size of the initialized part
+	int es_perm;			// PTE_U, plus PTE_W if writable
+};
+
+// Where env_scan is in the page tables of all envs, and what it does.
+struct EnvScan {
+	int sc_envx;			// Next env to look at ...
+	uintptr_t sc_va;		// ... and where in it
+	// Called on each present entry; nonzero stops the scan
+	int (*sc_pte)(struct Env *e, uintptr_t va, pte_t *pte, void *arg);
+	bool (*sc_skip)(struct Env *e);	// Envs to leave alone, or NULL
+	void (*sc_pass)(void);		// Start of each new pass, or NULL
+};
+
 extern struct Env *envs;		// All environments
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
@@ -18,6 +40,12 @@ void	env_create(uint8_t *binary, size_t size, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	env_scan(struct EnvScan *sc, int nptes, void *arg);
+int	env_demand_page(struct Env *e, uintptr_t va, bool write);
+int	env_prefault(struct Env *e, uintptr_t start, uintptr_t end, bool write);
+void	env_fault_around(struct Env *e, uintptr_t va, bool write);
+int	env_copy_segments(struct Env *dst, struct Env *src);
+int	env_copy_vm(struct Env *dst, struct Env *src);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -7,6 +7,8 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/rmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -48,6 +50,8 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
+	rmap_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
@@ -59,6 +63,7 @@ i386_init(void)
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
+	tsc_calibrate();
 
 	// Acquire the big kernel lock before waking up APs
 	// Your code here:
@@ -125,9 +130,11 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
+	thiscpu->cpu_pgdir = kern_pgdir;
 	env_init_percpu();
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
@@ -3,6 +3,7 @@
 /* Support for reading the NVRAM from the real-time clock. */
 
 #include <inc/x86.h>
+#include <inc/stdio.h>
 
 #include <kern/kclock.h>
 
@@ -20,3 +21,41 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+
+// Rate of the TSC in kHz, measured once at boot by tsc_calibrate().
+uint32_t tsc_khz;
+
+// Measure the TSC against channel 2 of the 8253/8254 PIT, whose input
+// clock runs at a fixed PIT_HZ.  Channel 2 is the speaker channel, so
+// it can be gated and polled without touching the IRQ 0 timer.
+void
+tsc_calibrate(void)
+{
+	uint32_t latch = PIT_HZ / (1000 / TSC_CALIBRATE_MS);
+	uint64_t t0, t1;
+
+	// Gate channel 2 on, speaker off.
+	outb(IO_PIT_GATE, (inb(IO_PIT_GATE) & ~0x02) | 0x01);
+	// Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count).
+	outb(IO_PIT_MODE, 0xB0);
+	outb(IO_PIT_CNT2, latch & 0xFF);
+	outb(IO_PIT_CNT2, latch >> 8);
+
+	t0 = read_tsc();
+	while (!(inb(IO_PIT_GATE) & 0x20))
+		;
+	t1 = read_tsc();
+
+	tsc_khz = (uint32_t) ((t1 - t0) / TSC_CALIBRATE_MS);
+	cprintf("TSC: %u kHz\n", tsc_khz);
+}
+
+// Milliseconds elapsed since the TSC was last reset (boot).
+uint32_t
+time_msec(void)
+{
+	if (!tsc_khz)
+		return 0;
+	return (uint32_t) (read_tsc() / tsc_khz);
+}
@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
@@ -23,10 +25,24 @@
 #define NVRAM_PEXTLO	(MC_NVRAM_START + 34)	/* low byte; RTC off. 0x30 */
 #define NVRAM_PEXTHI	(MC_NVRAM_START + 35)	/* high byte; RTC off. 0x31 */
 
+/* NVRAM bytes 38 and 39: memory above 16MB, in 64KB units */
+#define NVRAM_EXT16LO	(MC_NVRAM_START + 38)	/* low byte; RTC off. 0x34 */
+#define NVRAM_EXT16HI	(MC_NVRAM_START + 39)	/* high byte; RTC off. 0x35 */
+
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+#define	IO_PIT_CNT2	0x042		/* 8253 PIT channel 2 counter */
+#define	IO_PIT_MODE	0x043		/* 8253 PIT mode/command register */
+#define	IO_PIT_GATE	0x061		/* PIT channel 2 gate and output */
+#define	PIT_HZ		1193182		/* PIT input clock */
+#define	TSC_CALIBRATE_MS 10		/* length of the calibration run */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
+extern uint32_t tsc_khz;
+void tsc_calibrate(void);
+uint32_t time_msec(void);
+
 #endif	// !JOS_KERN_KCLOCK_H
@@ -0,0 +1,439 @@
+// Slab allocator for kernel objects.
+//
+// A kmem cache hands out objects of one size from slabs: single pages
+// with a small header at the start and the objects after it.  Free
+// objects of a slab are chained by index through the header's bufctl
+// array, never through the objects themselves, so objects keep their
+// constructed state while free.  In front of the slabs each CPU keeps
+// a small stack of free objects, so most allocations and frees touch
+// neither the slab lists nor another CPU's cache lines.
+//
+// kmalloc/kfree sit on top: power-of-two caches from 16 to KMEM_OBJ_MAX
+// bytes, and whole pages from the buddy allocator for anything bigger.
+//
+// Like the page allocator, this relies on the big kernel lock.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/mmu.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kmalloc.h>
+
+#define SLAB_END	0xFFFF		// End of a slab's free object chain
+
+struct Slab {
+	struct Slab *sl_next;		// Next slab on the cache's list
+	struct Slab *sl_prev;		// Previous slab on the cache's list
+	struct KmemCache *sl_cache;
+	uint16_t sl_inuse;		// Objects not on sl_free
+	uint16_t sl_free;		// First free object, or SLAB_END
+	uint16_t sl_bufctl[0];		// Free object following each object
+};
+
+// Empty slabs a cache keeps instead of giving their pages back.
+#define KMEM_KEEP_EMPTY	1
+
+// The cache the KmemCache structures themselves come from.
+static struct KmemCache cache_cache;
+static struct KmemCache *cache_list;
+
+#define KMALLOC_MIN_SHIFT	4
+#define KMALLOC_NCACHES		7	// 16, 32, ..., KMEM_OBJ_MAX bytes
+static struct KmemCache *kmalloc_caches[KMALLOC_NCACHES];
+static const char *kmalloc_names[KMALLOC_NCACHES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static void check_kmalloc(void);
+
+static struct Slab **
+slab_list(struct KmemCache *kc, struct Slab *sl)
+{
+	if (sl->sl_inuse == 0)
+		return &kc->kc_empty;
+	if (sl->sl_inuse == kc->kc_perslab)
+		return &kc->kc_full;
+	return &kc->kc_partial;
+}
+
+static void
+slab_list_remove(struct Slab **head, struct Slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		*head = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+static void
+slab_list_push(struct Slab **head, struct Slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *head;
+	if (*head)
+		(*head)->sl_prev = sl;
+	*head = sl;
+}
+
+static void *
+slab_obj(struct KmemCache *kc, struct Slab *sl, int i)
+{
+	return (char *) sl + kc->kc_offset + i * kc->kc_stride;
+}
+
+// Lay out cache 'kc' for objects of 'size' bytes aligned to 'align'.
+static void
+cache_setup(struct KmemCache *kc, const char *name, size_t size,
+	    size_t align, void (*ctor)(void *obj))
+{
+	int n;
+
+	if (!align)
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0 && align <= PGSIZE / 4);
+	if (size == 0 || size > KMEM_OBJ_MAX)
+		panic("kmem_cache_create: bad object size %u for %s", size, name);
+
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_stride = ROUNDUP(size, align);
+	kc->kc_ctor = ctor;
+
+	// As many objects as fit after the header and its bufctl array.
+	n = (PGSIZE - sizeof(struct Slab)) / (kc->kc_stride + sizeof(uint16_t));
+	while (ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), align)
+	       + n * kc->kc_stride > PGSIZE)
+		n--;
+	assert(n > 0 && n < SLAB_END);
+	kc->kc_perslab = n;
+	kc->kc_offset = ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), align);
+
+	kc->kc_next = cache_list;
+	cache_list = kc;
+}
+
+// Add a new slab to 'kc', constructing all its objects.
+static struct Slab *
+slab_grow(struct KmemCache *kc)
+{
+	struct PageInfo *pp;
+	struct Slab *sl;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pp->pp_flags |= PP_SLAB;
+	sl = page2kva(pp);
+	sl->sl_cache = kc;
+	sl->sl_inuse = 0;
+	sl->sl_free = 0;
+	for (i = 0; i < kc->kc_perslab; i++) {
+		sl->sl_bufctl[i] = i + 1 < kc->kc_perslab ? i + 1 : SLAB_END;
+		if (kc->kc_ctor)
+			kc->kc_ctor(slab_obj(kc, sl, i));
+	}
+	slab_list_push(&kc->kc_empty, sl);
+	kc->kc_nslabs++;
+	kc->kc_nempty++;
+	return sl;
+}
+
+// Give an empty slab's page back to the page allocator.
+static void
+slab_release(struct KmemCache *kc, struct Slab *sl)
+{
+	struct PageInfo *pp = pa2page(PADDR(sl));
+
+	slab_list_remove(&kc->kc_empty, sl);
+	kc->kc_nslabs--;
+	kc->kc_nempty--;
+	pp->pp_flags &= ~PP_SLAB;
+	page_free(pp);
+}
+
+// Take one object off the slabs of 'kc'.
+static void *
+slab_alloc_obj(struct KmemCache *kc)
+{
+	struct Slab *sl;
+	void *obj;
+	int i;
+
+	if (!(sl = kc->kc_partial) && !(sl = kc->kc_empty)
+	    && !(sl = slab_grow(kc)))
+		return NULL;
+
+	if (sl->sl_inuse == 0)
+		kc->kc_nempty--;
+	slab_list_remove(slab_list(kc, sl), sl);
+	i = sl->sl_free;
+	obj = slab_obj(kc, sl, i);
+	sl->sl_free = sl->sl_bufctl[i];
+	sl->sl_inuse++;
+	slab_list_push(slab_list(kc, sl), sl);
+	return obj;
+}
+
+// Put one object back on its slab.
+static void
+slab_free_obj(struct KmemCache *kc, void *obj)
+{
+	struct Slab *sl = ROUNDDOWN(obj, PGSIZE);
+	int i = ((char *) obj - (char *) slab_obj(kc, sl, 0)) / kc->kc_stride;
+
+	assert(sl->sl_cache == kc);
+	assert(obj == slab_obj(kc, sl, i) && sl->sl_inuse > 0);
+
+	slab_list_remove(slab_list(kc, sl), sl);
+	sl->sl_bufctl[i] = sl->sl_free;
+	sl->sl_free = i;
+	sl->sl_inuse--;
+	slab_list_push(slab_list(kc, sl), sl);
+	if (sl->sl_inuse == 0 && ++kc->kc_nempty > KMEM_KEEP_EMPTY)
+		slab_release(kc, sl);
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align' (a power
+// of two; 0 means pointer alignment).  'ctor', if not NULL, initializes
+// each object once, when its slab is created.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *obj))
+{
+	struct KmemCache *kc;
+
+	if (!(kc = kmem_cache_alloc(&cache_cache)))
+		return NULL;
+	cache_setup(kc, name, size, align, ctor);
+	return kc;
+}
+
+//
+// Destroy a cache none of whose objects are in use, giving all its
+// pages back.
+//
+void
+kmem_cache_destroy(struct KmemCache *kc)
+{
+	struct KmemCache **kcp;
+	struct KmemCpu *kcc;
+	int i;
+
+	if (kc->kc_active)
+		panic("kmem_cache_destroy: %d objects of %s still in use",
+		      kc->kc_active, kc->kc_name);
+	for (i = 0; i < NCPU; i++) {
+		kcc = &kc->kc_cpu[i];
+		while (kcc->kcc_count)
+			slab_free_obj(kc, kcc->kcc_objs[--kcc->kcc_count]);
+	}
+	while (kc->kc_empty)
+		slab_release(kc, kc->kc_empty);
+	assert(!kc->kc_partial && !kc->kc_full && !kc->kc_nslabs);
+
+	for (kcp = &cache_list; *kcp != kc; kcp = &(*kcp)->kc_next)
+		;
+	*kcp = kc->kc_next;
+	kmem_cache_free(&cache_cache, kc);
+}
+
+//
+// Allocate an object from 'kc'.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *kc)
+{
+	struct KmemCpu *kcc = &kc->kc_cpu[cpunum()];
+	void *obj;
+
+	if (!kcc->kcc_count) {
+		while (kcc->kcc_count < KMEM_CPU_BATCH
+		       && (obj = slab_alloc_obj(kc)))
+			kcc->kcc_objs[kcc->kcc_count++] = obj;
+		if (!kcc->kcc_count)
+			return NULL;
+	}
+	kc->kc_active++;
+	return kcc->kcc_objs[--kcc->kcc_count];
+}
+
+//
+// Return an object to 'kc'.  If the cache has a constructor the
+// object must be in its constructed state again.
+//
+void
+kmem_cache_free(struct KmemCache *kc, void *obj)
+{
+	struct KmemCpu *kcc = &kc->kc_cpu[cpunum()];
+	int i;
+
+	if (kcc->kcc_count == KMEM_CPU_SIZE) {
+		// Keep the most recently freed, cache-hot objects.
+		for (i = 0; i < KMEM_CPU_BATCH; i++)
+			slab_free_obj(kc, kcc->kcc_objs[i]);
+		memmove(kcc->kcc_objs, kcc->kcc_objs + KMEM_CPU_BATCH,
+			(KMEM_CPU_SIZE - KMEM_CPU_BATCH) * sizeof(kcc->kcc_objs[0]));
+		kcc->kcc_count -= KMEM_CPU_BATCH;
+	}
+	kcc->kcc_objs[kcc->kcc_count++] = obj;
+	kc->kc_active--;
+}
+
+//
+// Allocate 'size' bytes of kernel memory, or return NULL.
+// Small sizes come from the kmalloc caches, aligned to the smaller of
+// their size and 8 bytes; anything over KMEM_OBJ_MAX gets whole,
+// page-aligned pages.  The memory is not zeroed.
+//
+void *
+kmalloc(size_t size)
+{
+	struct PageInfo *pp;
+	int i, order;
+
+	if (size == 0)
+		return NULL;
+	if (size <= KMEM_OBJ_MAX) {
+		for (i = 0; (1 << (i + KMALLOC_MIN_SHIFT)) < size; i++)
+			;
+		return kmem_cache_alloc(kmalloc_caches[i]);
+	}
+
+	for (order = 0; (PGSIZE << order) < size; order++)
+		;
+	if (!(pp = page_alloc_order(order, 0)))
+		return NULL;
+	pp->pp_order = order;
+	pp->pp_flags |= PP_KMALLOC;
+	return page2kva(pp);
+}
+
+//
+// Free memory from kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *ptr)
+{
+	struct PageInfo *pp;
+
+	if (!ptr)
+		return;
+	pp = pa2page(PADDR(ptr));
+	if (pp->pp_flags & PP_SLAB) {
+		kmem_cache_free(((struct Slab *) ROUNDDOWN(ptr, PGSIZE))->sl_cache,
+				ptr);
+	} else if (pp->pp_flags & PP_KMALLOC) {
+		assert(ptr == page2kva(pp));
+		pp->pp_flags &= ~PP_KMALLOC;
+		page_free_order(pp, pp->pp_order);
+	} else
+		panic("kfree: %08x was not allocated by kmalloc", ptr);
+}
+
+//
+// Print every cache's object size and utilization.
+//
+void
+kmem_print_stats(void)
+{
+	struct KmemCache *kc;
+	int i, cached, total;
+
+	cprintf("cache            objsize perslab  slabs  empty active cached  total  use%%\n");
+	for (kc = cache_list; kc; kc = kc->kc_next) {
+		for (cached = i = 0; i < NCPU; i++)
+			cached += kc->kc_cpu[i].kcc_count;
+		total = kc->kc_nslabs * kc->kc_perslab;
+		cprintf("%-16s %7u %7d %6d %6d %6d %6d %6d %4d%%\n",
+			kc->kc_name, kc->kc_size, kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_nempty, kc->kc_active, cached,
+			total, total ? kc->kc_active * 100 / total : 0);
+	}
+}
+
+void
+kmem_init(void)
+{
+	int i;
+
+	cache_setup(&cache_cache, "kmem_cache", sizeof(struct KmemCache),
+		    0, NULL);
+	for (i = 0; i < KMALLOC_NCACHES; i++)
+		if (!(kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+				1 << (i + KMALLOC_MIN_SHIFT), 8, NULL)))
+			panic("kmem_init: out of memory");
+
+	check_kmalloc();
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+#define CHECK_OBJ_SIZE	200
+
+static void
+check_ctor(void *obj)
+{
+	memset(obj, 0x5a, CHECK_OBJ_SIZE);
+}
+
+static void
+check_kmalloc(void)
+{
+	struct KmemCache *kc;
+	char *p[64], *big;
+	int i, j, n;
+
+	// objects are distinct, aligned, and come back in one piece
+	for (i = 0; i < 64; i++) {
+		assert((p[i] = kmalloc(24)));
+		assert(((uintptr_t) p[i] & 7) == 0);
+		memset(p[i], i, 24);
+	}
+	for (i = 0; i < 64; i++)
+		for (j = 0; j < 24; j++)
+			assert(p[i][j] == i);
+	for (i = 0; i < 64; i++)
+		kfree(p[i]);
+
+	// big requests get whole pages
+	assert((big = kmalloc(3 * PGSIZE)));
+	assert((uintptr_t) big % PGSIZE == 0);
+	memset(big, 1, 3 * PGSIZE);
+	kfree(big);
+
+	// constructed objects keep their state across free and alloc,
+	// and a cache spreads over as many slabs as it needs
+	assert((kc = kmem_cache_create("check", CHECK_OBJ_SIZE, 0, check_ctor)));
+	n = 2 * kc->kc_perslab + 1;
+	assert(n <= 64);
+	for (i = 0; i < n; i++) {
+		assert((p[i] = kmem_cache_alloc(kc)));
+		for (j = 0; j < CHECK_OBJ_SIZE; j++)
+			assert((uint8_t) p[i][j] == 0x5a);
+	}
+	assert(kc->kc_nslabs == 3 && kc->kc_active == n);
+	for (i = 0; i < n; i++)
+		kmem_cache_free(kc, p[i]);
+	assert(kc->kc_active == 0);
+	assert((p[0] = kmem_cache_alloc(kc)));
+	for (j = 0; j < CHECK_OBJ_SIZE; j++)
+		assert((uint8_t) p[0][j] == 0x5a);
+	kmem_cache_free(kc, p[0]);
+	kmem_cache_destroy(kc);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
@@ -0,0 +1,58 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+// Largest object a slab cache holds.  kmalloc serves bigger requests
+// with whole pages.
+#define KMEM_OBJ_MAX		1024
+
+// Per-CPU object cache of a kmem cache.
+#define KMEM_CPU_SIZE		16	// Objects a CPU keeps at most
+#define KMEM_CPU_BATCH		8	// Objects moved to/from the slabs at once
+
+struct KmemCpu {
+	int kcc_count;
+	void *kcc_objs[KMEM_CPU_SIZE];
+};
+
+// An object cache: a set of one-page slabs carved into objects of one
+// size.  If kc_ctor is set it is run on every object when its slab is
+// created, not on every allocation, so objects must be handed back to
+// kmem_cache_free in their constructed state.
+struct KmemCache {
+	const char *kc_name;
+	size_t kc_size;			// Object size as requested
+	size_t kc_stride;		// Object size rounded up to the alignment
+	size_t kc_offset;		// Offset of the first object in a slab
+	int kc_perslab;			// Objects per slab
+	void (*kc_ctor)(void *obj);
+
+	struct Slab *kc_partial;	// Slabs with free and used objects
+	struct Slab *kc_full;		// Slabs with no free objects
+	struct Slab *kc_empty;		// Slabs with no used objects
+	int kc_nslabs;			// Slabs on all three lists
+	int kc_nempty;			// Slabs on kc_empty
+	int kc_active;			// Objects handed out to callers
+
+	struct KmemCpu kc_cpu[NCPU];
+	struct KmemCache *kc_next;	// Next on the list of all caches
+};
+
+void	kmem_init(void);
+struct KmemCache *kmem_cache_create(const char *name, size_t size,
+				    size_t align, void (*ctor)(void *obj));
+void	kmem_cache_destroy(struct KmemCache *kc);
+void *	kmem_cache_alloc(struct KmemCache *kc);
+void	kmem_cache_free(struct KmemCache *kc, void *obj);
+void *	kmalloc(size_t size);
+void	kfree(void *ptr);
+void	kmem_print_stats(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
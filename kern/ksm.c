@@ -0,0 +1,284 @@
+// Same-page merging of anonymous user memory.
+//
+// Idle CPUs (sched_halt) walk the page tables of all envs a few pages
+// at a time and hash every private, writable user page.  When two
+// pages turn out to be byte-identical, both mappings are pointed at
+// one of them, read-only and PTE_COW, and the other page is freed.
+// Pages of zeros are merged into the shared zero page instead.
+//
+// A merged ("stable") page is marked PP_KSM and the merger holds a
+// reference to it, so it stays put while envs map it.  The first write
+// to it is handled by page_unshare, in the kernel, whether or not the
+// env has a fault handler of its own.  A stable page nobody maps any
+// more is released at the end of each pass.
+//
+// Pages that have been seen once are remembered ("unstable") by env,
+// address and hash until the end of the pass.  Hashes only pick
+// candidates: a page is write-protected and compared byte by byte
+// before it is merged, so a page written concurrently by another CPU
+// is never lost.
+//
+// Like everything else here, this relies on the big kernel lock.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/ksm.h>
+
+#define KSM_HASH_SIZE	256	// Slots in each of the two tables
+#define KSM_SCAN_PTES	1024	// Page table entries looked at per visit
+#define KSM_SCAN_PAGES	8	// Pages hashed per visit
+
+struct KsmStable {
+	uint32_t ks_hash;
+	struct PageInfo *ks_page;	// Merged page, or NULL
+};
+
+struct KsmUnstable {
+	uint32_t ku_hash;
+	envid_t ku_envid;		// Env that mapped the page, or 0
+	uintptr_t ku_va;		// ... and where
+};
+
+struct KsmStats ksm_stats;
+
+static struct KsmStable ksm_stable[KSM_HASH_SIZE];
+static struct KsmUnstable ksm_unstable[KSM_HASH_SIZE];
+static uint32_t ksm_zero_hash;
+
+static int ksm_scan_pte(struct Env *e, uintptr_t va, pte_t *pte, void *arg);
+static void ksm_end_pass(void);
+
+// Scan position: the next page table entry to look at.
+static struct EnvScan ksm_scan = {
+	.sc_pte = ksm_scan_pte,
+	.sc_pass = ksm_end_pass,
+};
+
+// FNV-1a over the words of the page 'pp'.
+static uint32_t
+ksm_hash(struct PageInfo *pp)
+{
+	const uint32_t *w = kmap(pp);
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ w[i]) * 16777619U;
+	kunmap((void *) w);
+	return h;
+}
+
+// True if the pages 'pp' and 'kp' hold the same bytes.
+static bool
+ksm_same(struct PageInfo *pp, struct PageInfo *kp)
+{
+	void *a = kmap(pp), *b = kmap(kp);
+	bool same = memcmp(a, b, PGSIZE) == 0;
+
+	kunmap(b);
+	kunmap(a);
+	return same;
+}
+
+// True if the page 'pp' that 'pte' maps may be merged: private user
+// memory the env can write.  The exception stack is left alone: the
+// kernel writes fault frames there and fork never shares it.
+static bool
+ksm_candidate(uintptr_t va, pte_t pte, struct PageInfo *pp)
+{
+	if ((pte & (PTE_P | PTE_U | PTE_W)) != (PTE_P | PTE_U | PTE_W))
+		return 0;
+	if (pte & (PTE_COW | PTE_PS))
+		return 0;
+	if (va >= UXSTACKTOP - PGSIZE)
+		return 0;
+	return pp != zero_page && pp->pp_ref == 1
+		&& !(pp->pp_flags & (PP_KSM | PP_SLAB | PP_KMALLOC));
+}
+
+// Point 'e's mapping of 'va' (whose entry is 'pte') at 'kp', read-only
+// and copy-on-write, if the two pages hold the same bytes.  Returns
+// true if it did; the old page is freed.
+static bool
+ksm_merge(struct Env *e, uintptr_t va, pte_t *pte, struct PageInfo *kp)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte));
+	int perm = *pte & PTE_SYSCALL;
+
+	// Stop all writers before comparing.
+	*pte &= ~PTE_W;
+	tlb_invalidate(e->env_pgdir, (void *) va);
+	if (!ksm_same(pp, kp)
+	    || page_insert(e->env_pgdir, kp, (void *) va,
+			   ZERO_PAGE_PERM(perm)) < 0) {
+		*pte |= PTE_W;
+		tlb_invalidate(e->env_pgdir, (void *) va);
+		return 0;
+	}
+	return 1;
+}
+
+// The page remembered in 'ku', if it is still mapped where it was, is
+// still a candidate and still has the same hash.  Sets *env_store and
+// *pte_store.
+static struct PageInfo *
+ksm_unstable_page(struct KsmUnstable *ku, struct Env **env_store,
+		  pte_t **pte_store)
+{
+	struct Env *e = &envs[ENVX(ku->ku_envid)];
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if (!ku->ku_envid || e->env_id != ku->ku_envid
+	    || e->env_status == ENV_FREE || e->env_status == ENV_DYING)
+		return NULL;
+	if (!(e->env_pgdir[PDX(ku->ku_va)] & PTE_W))
+		return NULL;
+	if (!(pte = pgdir_walk(e->env_pgdir, (void *) ku->ku_va, 0))
+	    || !(*pte & PTE_P))
+		return NULL;
+	pp = pa2page(PTE_ADDR(*pte));
+	if (!ksm_candidate(ku->ku_va, *pte, pp)
+	    || ksm_hash(pp) != ku->ku_hash)
+		return NULL;
+	*env_store = e;
+	*pte_store = pte;
+	return pp;
+}
+
+// Drop the merger's reference to the stable page in 'ks', if nobody
+// else maps it.  Returns true if the slot is free afterwards.
+static bool
+ksm_release(struct KsmStable *ks)
+{
+	struct PageInfo *pp = ks->ks_page;
+
+	if (!pp)
+		return 1;
+	if (pp->pp_ref > 1)
+		return 0;
+	pp->pp_flags &= ~PP_KSM;
+	ks->ks_page = NULL;
+	ksm_stats.ks_shared--;
+	page_decref(pp);
+	return 1;
+}
+
+// Make the page 'kp', mapped by 'e' at 'va', the stable page in 'ks'.
+static bool
+ksm_promote(struct KsmStable *ks, uint32_t h, struct Env *e,
+	    uintptr_t va, pte_t *pte, struct PageInfo *kp)
+{
+	if (!ksm_release(ks))
+		return 0;
+	if (page_insert(e->env_pgdir, kp, (void *) va,
+			ZERO_PAGE_PERM(*pte & PTE_SYSCALL)) < 0)
+		return 0;
+	kp->pp_flags |= PP_KSM;
+	kp->pp_ref++;
+	ks->ks_hash = h;
+	ks->ks_page = kp;
+	ksm_stats.ks_shared++;
+	return 1;
+}
+
+// Look at the page 'e' maps at 'va'.
+static void
+ksm_scan_page(struct Env *e, uintptr_t va, pte_t *pte, int *nhashed)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte)), *kp;
+	struct KsmStable *ks;
+	struct KsmUnstable *ku;
+	struct Env *ke;
+	pte_t *kpte;
+	uint32_t h;
+
+	if (!ksm_candidate(va, *pte, pp))
+		return;
+	h = ksm_hash(pp);
+	ksm_stats.ks_scanned++;
+	++*nhashed;
+
+	if (h == ksm_zero_hash && zero_page) {
+		if (ksm_merge(e, va, pte, zero_page))
+			ksm_stats.ks_zeroed++;
+		return;
+	}
+
+	ks = &ksm_stable[h % KSM_HASH_SIZE];
+	if (ks->ks_page && ks->ks_hash == h) {
+		if (ksm_merge(e, va, pte, ks->ks_page))
+			ksm_stats.ks_merged++;
+		return;
+	}
+
+	ku = &ksm_unstable[h % KSM_HASH_SIZE];
+	if (ku->ku_hash == h && (ku->ku_envid != e->env_id || ku->ku_va != va)
+	    && (kp = ksm_unstable_page(ku, &ke, &kpte))
+	    && ksm_promote(ks, h, ke, ku->ku_va, kpte, kp)) {
+		ku->ku_envid = 0;
+		if (ksm_merge(e, va, pte, kp))
+			ksm_stats.ks_merged++;
+		return;
+	}
+	ku->ku_hash = h;
+	ku->ku_envid = e->env_id;
+	ku->ku_va = va;
+}
+
+// env_scan callback: look at a page, until enough have been hashed.
+static int
+ksm_scan_pte(struct Env *e, uintptr_t va, pte_t *pte, void *arg)
+{
+	int *nhashed = arg;
+
+	ksm_scan_page(e, va, pte, nhashed);
+	return *nhashed >= KSM_SCAN_PAGES;
+}
+
+// End of a pass over all envs: forget the unstable pages, which may
+// have changed since, and let go of stable pages nobody maps.
+static void
+ksm_end_pass(void)
+{
+	int i;
+
+	for (i = 0; i < KSM_HASH_SIZE; i++)
+		ksm_release(&ksm_stable[i]);
+	memset(ksm_unstable, 0, sizeof(ksm_unstable));
+	ksm_stats.ks_passes++;
+}
+
+//
+// Scan a few more pages for merging.  Called by CPUs that have nothing
+// better to do (sched_halt), with the kernel lock held.
+//
+void
+ksm_scan_idle(void)
+{
+	int nhashed = 0;
+
+	if (!zero_page)
+		return;
+	if (!ksm_zero_hash)
+		ksm_zero_hash = ksm_hash(zero_page);
+	env_scan(&ksm_scan, KSM_SCAN_PTES, &nhashed);
+}
+
+void
+ksm_print_stats(void)
+{
+	cprintf("Same-page merging: %u passes, %u pages hashed\n",
+		ksm_stats.ks_passes, ksm_stats.ks_scanned);
+	cprintf("  shared pages now:   %5u\n", ksm_stats.ks_shared);
+	cprintf("  merged mappings:    %5u (%u onto the zero page)\n",
+		ksm_stats.ks_merged + ksm_stats.ks_zeroed, ksm_stats.ks_zeroed);
+	cprintf("  unmerged on write:  %5u\n", ksm_stats.ks_unmerged);
+}
@@ -0,0 +1,25 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Same-page merging counters (see kern/ksm.c).
+struct KsmStats {
+	uint32_t ks_scanned;	// Candidate pages hashed, ever
+	uint32_t ks_merged;	// Mappings moved onto a shared page, ever
+	uint32_t ks_zeroed;	// Mappings moved onto the zero page, ever
+	uint32_t ks_unmerged;	// Shared mappings copied again on write, ever
+	uint32_t ks_shared;	// Shared pages the merger holds now
+	uint32_t ks_passes;	// Full passes over all envs
+};
+extern struct KsmStats ksm_stats;
+
+void	ksm_scan_idle(void);
+void	ksm_print_stats(void);
+
+#endif	// !JOS_KERN_KSM_H
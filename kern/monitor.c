@@ -11,8 +11,16 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/cpu.h>
 
 #include <kern/pmap.h>		// Lab2: Challenge
+#include <kern/kmalloc.h>
+#include <kern/vmalloc.h>
+#include <kern/ksm.h>
+#include <kern/zram.h>
+#include <kern/rmap.h>
+#include <kern/vma.h>
+#include <kern/env.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -57,6 +65,20 @@ static struct Command commands[] = {
 			"\tUsage: "
 			"dump <--physical|--virtual> <from hexa address> <to hexa address>",
 			mon_dump},
+	{ "buddyinfo", "Display free memory by block order, and zeroed pool hit rates",
+			mon_buddyinfo},
+	{ "slabinfo", "Display the object size and utilization of each kmem cache",
+			mon_slabinfo},
+	{ "vmallocinfo", "Display the kernel address ranges of vmalloc and ioremap",
+			mon_vmallocinfo},
+	{ "pgtables", "Display the pages each environment spends on page tables",
+			mon_pgtables},
+	{ "ksminfo", "Display same-page merging counters", mon_ksminfo},
+	{ "zraminfo", "Display compressed swap usage and cost", mon_zraminfo},
+	{ "rmap", "Display every mapping of the page at a physical address\n"
+			"\tUsage: rmap <hexa physical address>", mon_rmap},
+	{ "vmas", "Display the regions an environment may have mapped\n"
+			"\tUsage: vmas <hexa envid>", mon_vmas},
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -197,11 +219,15 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf) {
 			cprintf("0x%08x : NULL\n",iterator);
 			continue;
 		}
-		cprintf("Vaddress: 0x%08x, Paddress: 0x%08x, P=%01d, W=%01d, U=%01d \n",
-				iterator, PTE_ADDR(*pte),
+		physaddr_t pa = (*pte & PTE_PS) ?
+				PDE_LARGE_ADDR(*pte) + (iterator & (PTSIZE - PGSIZE)) :
+				PTE_ADDR(*pte);
+		cprintf("Vaddress: 0x%08x, Paddress: 0x%08x, P=%01d, W=%01d, U=%01d, PS=%01d \n",
+				iterator, pa,
 				(*pte & PTE_P)? 1 : 0,
 				(*pte & PTE_W)? 1 : 0,
-				(*pte & PTE_U)? 1 : 0);
+				(*pte & PTE_U)? 1 : 0,
+				(*pte & PTE_PS)? 1 : 0);
 	}
 	return 0;
 }
@@ -310,6 +336,122 @@ mon_dump(int argc, char** argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t n, total = 0;
+	int order, cpu;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		n = page_free_blocks(order);
+		cprintf("  order %2d (%4dKB): %5u free\n",
+			order, (PGSIZE << order) / 1024, n);
+		total += n << order;
+	}
+	for (cpu = 0; cpu < ncpu; cpu++) {
+		n = page_mag_pages(cpu);
+		cprintf("  CPU %d magazine:    %5u free\n", cpu, n);
+		total += n;
+	}
+	n = page_extent_pages();
+	cprintf("  not yet carved:     %5u free\n", n);
+	total += n;
+	n = page_high_pages();
+	cprintf("  high memory:        %5u free\n", n);
+	total += n;
+	n = page_zero_stats.pz_hits + page_zero_stats.pz_misses;
+	cprintf("  zeroed pool:        %5u free\n", page_zero_stats.pz_pooled);
+	total += page_zero_stats.pz_pooled;
+	cprintf("Free memory: %u pages, %uKB\n", total, total * PGSIZE / 1024);
+	cprintf("ALLOC_ZERO: %u from the zeroed pool, %u zeroed inline (%u%% hits); "
+		"%u pages zeroed while idle\n",
+		page_zero_stats.pz_hits, page_zero_stats.pz_misses,
+		n ? page_zero_stats.pz_hits * 100 / n : 0,
+		page_zero_stats.pz_zeroed);
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
+int
+mon_vmallocinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	vm_print();
+	return 0;
+}
+
+int
+mon_pgtables(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t n, total = 0;
+	int i;
+
+	for (i = 0; i < NENV; i++) {
+		if (envs[i].env_status == ENV_FREE || !envs[i].env_pgdir)
+			continue;
+		n = pgdir_pgtable_pages(envs[i].env_pgdir);
+		cprintf("  env %08x: %3u pages (%uKB)\n",
+			envs[i].env_id, n, n * PGSIZE / 1024);
+		total += n;
+	}
+	cprintf("Page tables: %u pages, %uKB\n", total, total * PGSIZE / 1024);
+	return 0;
+}
+
+int
+mon_ksminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	ksm_print_stats();
+	return 0;
+}
+
+int
+mon_zraminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	zram_print_stats();
+	return 0;
+}
+
+int
+mon_rmap(int argc, char **argv, struct Trapframe *tf)
+{
+	physaddr_t pa;
+
+	if (argc != 2) {
+		cprintf("You've entered %d arguments instead of 1\n", argc - 1);
+		return 1;
+	}
+	pa = strtol(argv[1], NULL, 16);
+	if (PGNUM(pa) >= npages) {
+		cprintf("No such physical page: %08x\n", pa);
+		return 1;
+	}
+	rmap_print(pa2page(pa));
+	return 0;
+}
+
+int
+mon_vmas(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+
+	if (argc != 2) {
+		cprintf("You've entered %d arguments instead of 1\n", argc - 1);
+		return 1;
+	}
+	if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0 || !e || !e->env_pgdir) {
+		cprintf("No such environment: %s\n", argv[1]);
+		return 1;
+	}
+	vma_print(e);
+	return 0;
+}
+
 /*****************************************************************************/
 
 /***** Kernel monitor command interpreter *****/
@@ -19,5 +19,13 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_showmappingsPD(int argc, char **argv, struct Trapframe *tf);
 int mon_permissionsManage(int argc, char **argv, struct Trapframe *tf);
 int mon_dump(int argc, char **argv, struct Trapframe *tf);
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_pgtables(int argc, char **argv, struct Trapframe *tf);
+int mon_ksminfo(int argc, char **argv, struct Trapframe *tf);
+int mon_vmallocinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_zraminfo(int argc, char **argv, struct Trapframe *tf);
+int mon_rmap(int argc, char **argv, struct Trapframe *tf);
+int mon_vmas(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -11,15 +11,89 @@
 #include <kern/env.h>
 #include <kern/cpu.h>
 #include <kern/monitor.h>
+#include <kern/ksm.h>
+#include <kern/zram.h>
+#include <kern/rmap.h>
+#include <kern/vmalloc.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
+size_t npages_low;		// ... of it in the direct map at KERNBASE
 static size_t npages_basemem;	// Amount of base memory (in pages)
 
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+struct PageLink *page_links;	// ... free list links,
+uint16_t *page_nptes;		// ... page table entry counts
+union PageRmap *page_rmaps;	// ... and reverse maps (see kern/pmap.h)
+
+// Free physical memory, managed by a binary buddy allocator: free_area[k]
+// lists the free, naturally aligned blocks of 2^k contiguous pages.
+struct FreeArea {
+	struct PageInfo *fa_head;	// First block on the list
+	size_t fa_nfree;		// Number of blocks on the list
+};
+static struct FreeArea free_area[PAGE_MAX_ORDER + 1];
+
+// Free memory that has never been handed to the buddy allocator, as
+// ranges [pe_start, pe_end) of page numbers.  page_init only records
+// these ranges, one per stretch of RAM between holes, so it does not
+// have to touch every PageInfo; page_alloc_order carves blocks off the
+// lowest extent when free_area runs dry, and only then initializes
+// their metadata (page_meta_clear).  The PageInfo of a page inside an
+// extent is garbage and must not be looked at.
+#define PAGE_EXTENT_MAX	8
+struct PageExtent {
+	size_t pe_start;
+	size_t pe_end;
+};
+static struct PageExtent page_extents[PAGE_EXTENT_MAX];
+static int npage_extents;
+static size_t page_extent_limit;	// Carve only pages below this
+static bool page_extents_frozen;	// Carve nothing (see check_steal_free_pages)
+
+// Per-CPU magazines of free single pages in front of the buddy
+// allocator.  page_alloc and page_free work on the local magazine and
+// only go to free_area to refill or drain it, PAGE_MAG_BATCH pages at
+// a time.  A magazine only belongs to its own CPU.
+#define PAGE_MAG_SIZE	64
+#define PAGE_MAG_BATCH	32
+struct PageMagazine {
+	struct PageInfo *pm_pages[PAGE_MAG_SIZE];
+	int pm_count;
+};
+static struct PageMagazine page_mags[NCPU];
+
+// Pool of pages zeroed ahead of time by idle CPUs (see page_zero_idle),
+// chained through PP_LINK.  The buddy allocator considers them in use.
+// page_alloc(ALLOC_ZERO) takes from here first, so the memset is off
+// the fault path.
+#define PAGE_ZERO_POOL_MAX	256	// Pages the idle CPUs keep zeroed
+#define PAGE_ZERO_BATCH		16	// Pages zeroed per visit to the idle loop
+static struct PageInfo *zero_pool;
+struct PageZeroStats page_zero_stats;
+
+// Physical memory above the direct map, pages [npages_low, npages), is
+// "high memory".  It has no kernel address of its own, so it only goes
+// to user pages (page_alloc with ALLOC_HIGHMEM), which the kernel reaches
+// through a kmap window when it has to.  High pages from page_high_next
+// up have never been handed out and their PageInfo is garbage; freed
+// ones are chained through PP_LINK.  None of this is used on a machine
+// with less than 220MB.
+static size_t page_high_next;
+static struct PageInfo *page_high_free;
+static size_t page_high_nfree;		// Pages on page_high_free
+
+// The kmap windows: KMAP_SLOTS pages per CPU at KMAPBASE, used like a
+// stack (see kmap).
+static pte_t *kmap_ptes;
+static int kmap_depth[NCPU];
+
+// A page of zeros that anonymous memory and untouched bss map, read-only
+// and copy-on-write, until they are first written.  It is never freed:
+// mappings of it are not counted in pp_ref (see page_insert).
+struct PageInfo *zero_page;
 
 
 // --------------------------------------------------------------
@@ -35,24 +109,39 @@ nvram_read(int r)
 static void
 i386_detect_memory(void)
 {
-	size_t npages_extmem;
+	size_t npages_extmem, npages_ext16mem;
 
 	// Use CMOS calls to measure available base & extended memory.
 	// (CMOS calls return results in kilobytes.)
 	npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
 	npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+	// The extended memory count tops out at 64MB; what lies above
+	// 16MB is counted separately, in 64KB units.
+	npages_ext16mem = (nvram_read(NVRAM_EXT16LO) * 64 * 1024) / PGSIZE;
 
 	// Calculate the number of physical pages available in both base
 	// and extended memory.
-	if (npages_extmem)
+	if (npages_ext16mem)
+		npages = (16 * 1024 * 1024 / PGSIZE) + npages_ext16mem;
+	else if (npages_extmem)
 		npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
 	else
 		npages = npages_basemem;
+	// Physical addresses are 32 bits wide, and PCs keep the last
+	// half gigabyte below 4GB for devices.
+	npages = MIN(npages, PGNUM(0xE0000000));
+	if (npages > PGNUM(EXTPHYSMEM))
+		npages_extmem = npages - PGNUM(EXTPHYSMEM);
 
-	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
+	// Only what fits below VMALLOCBASE is mapped at KERNBASE.
+	npages_low = MIN(npages, PGNUM(VMALLOCBASE - KERNBASE));
+
+	cprintf("Physical memory: %uK available, base = %uK, extended = %uK"
+		" (%uK high)\n",
 		npages * PGSIZE / 1024,
 		npages_basemem * PGSIZE / 1024,
-		npages_extmem * PGSIZE / 1024);
+		npages_extmem * PGSIZE / 1024,
+		(npages - npages_low) * PGSIZE / 1024);
 }
 
 
@@ -61,8 +150,17 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void kmap_init(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static struct PageInfo *pgtable_page(pde_t *pgdir, const void *va);
+static void page_extent_add(size_t start, size_t end);
+static bool page_extent_holds(size_t pn);
+static bool page_extent_carve(void);
+static struct PageInfo *zero_pool_take(void);
+static struct PageInfo *page_alloc_high(void);
+static void page_meta_clear(size_t start, size_t end);
 static void check_page_free_list(bool only_low_memory);
+static void check_page_alloc_order(void);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
@@ -80,7 +178,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the free_area lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -109,6 +207,10 @@ boot_alloc(uint32_t n)
 		if ((uint32_t)result>=(uint32_t)nextfree){
 			panic("out of memory");
 		}
+		// Nothing beyond EARLYMEM is mapped until kern_pgdir is.
+		if ((uint32_t)nextfree > KERNBASE + EARLYMEM){
+			panic("boot_alloc: out of early memory");
+		}
 	}else{//n==0
 //		result = nextfree;
 	}
@@ -158,6 +260,11 @@ mem_init(void)
 	// array.  'npages' is the number of physical pages in memory.
 	// Your code goes here:
 	pages = (struct PageInfo *)boot_alloc(npages*sizeof(struct PageInfo));
+	// The rest of the per-page metadata lives in arrays beside it, so
+	// that refcount-heavy paths touch only the small PageInfo.
+	page_links = boot_alloc(npages * sizeof(struct PageLink));
+	page_nptes = boot_alloc(npages * sizeof(uint16_t));
+	page_rmaps = boot_alloc(npages * sizeof(union PageRmap));
 	//////////////////////////////////////////////////////////////////////
 	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
 	// LAB 3: Your code here.
@@ -226,22 +333,25 @@ mem_init(void)
 //			PTE_P | PTE_W);
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
-	// Ie.  the VA range [KERNBASE, 2^32) should map to
-	//      the PA range [0, 2^32 - KERNBASE)
-	// We might not have 2^32 - KERNBASE bytes of physical memory, but
-	// we just set up the mapping anyway.
+	// Ie.  the VA range [KERNBASE, VMALLOCBASE) should map to
+	//      the PA range [0, VMALLOCBASE - KERNBASE)
+	// We might not have VMALLOCBASE - KERNBASE bytes of physical memory,
+	// but we just set up the mapping anyway.  Memory above that is
+	// reached through the kmap windows.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
 		//lab3
 			boot_map_region(
 					kern_pgdir,
 					KERNBASE,
-					ROUNDUP(0xFFFFFFFF - KERNBASE-1, PGSIZE),
+					VMALLOCBASE - KERNBASE,
 					0,
 					PTE_P | PTE_W);
 	// lab4
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
+	kmap_init();
+	vm_init();
 
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
@@ -254,8 +364,14 @@ mem_init(void)
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
 	lcr3(PADDR(kern_pgdir));
+	thiscpu->cpu_pgdir = kern_pgdir;
+
+	// All of low memory is mapped now; let the allocator have the
+	// rest of it.
+	page_extent_limit = npages_low;
 
 	check_page_free_list(0);
+	check_page_alloc_order();
 
 	// entry.S set the really important flags in cr0 (including enabling
 	// paging).  Here we configure the rest of the flags that we care about.
@@ -263,9 +379,40 @@ mem_init(void)
 	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_MP;
 	cr0 &= ~(CR0_TS|CR0_EM);
 	lcr0(cr0);
+	mem_init_percpu();
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	check_vmalloc();
+	check_zram();
+
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref = 1;
+}
+
+// Per-CPU MMU setup, once kern_pgdir is loaded: turn on global pages,
+// so the kernel half of the TLB is not flushed on every lcr3.
+//
+// PCID would also keep user TLB entries across switches, but CR4.PCIDE
+// can only be set in IA-32e mode, so it is of no use to a 32-bit kernel.
+//
+// Also make the third entry of the PAT, which PTE_PCD alone selects,
+// write-combining instead of UC-, for vmap_cache_bits.  Every CPU must
+// have the same PAT.  Without a PAT, PTE_PCD still means uncached.
+void
+mem_init_percpu(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (edx & CPUID_FEAT_PGE)
+		lcr4(rcr4() | CR4_PGE);
+	if (edx & CPUID_FEAT_PAT) {
+		wrmsr(MSR_PAT, PAT_ENTRIES(PAT_WB, PAT_WT, PAT_WC, PAT_UC));
+		lcr3(rcr3());
+	}
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -303,17 +450,79 @@ mem_init_mp(void)
 	}
 }
 
+// Set up the page table of the kmap windows at KMAPBASE.  Env page
+// directories copy its entry along with the rest of the kernel's, so
+// the windows work in every address space.
+static void
+kmap_init(void)
+{
+	struct PageInfo *pp;
+
+	static_assert(NCPU * KMAP_SLOTS <= NPTENTRIES);
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		panic("kmap_init: out of memory");
+	pp->pp_ref++;
+	kern_pgdir[PDX(KMAPBASE)] = page2pa(pp) | PTE_P | PTE_W;
+	kmap_ptes = page2kva(pp);
+}
+
+//
+// Return a kernel address of the page 'pp'.  A page of low memory is in
+// the direct map already; a page of high memory is mapped into the next
+// free kmap window of this CPU, until kunmap.  The windows are a stack:
+// kunmap the most recent kmap first, and not after anything that could
+// run another env on this CPU.
+//
+void *
+kmap(struct PageInfo *pp)
+{
+	int cpu = cpunum(), slot;
+	uintptr_t va;
+
+	if (!page_is_high(pp))
+		return page2kva(pp);
+	if ((slot = kmap_depth[cpu]++) >= KMAP_SLOTS)
+		panic("kmap: CPU %d has no free window", cpu);
+	va = KMAPBASE + (cpu * KMAP_SLOTS + slot) * PGSIZE;
+	// The window is this CPU's alone, so no other TLB can hold it.
+	kmap_ptes[PTX(va)] = page2pa(pp) | PTE_P | PTE_W;
+	invlpg((void *) va);
+	return (void *) va;
+}
+
+//
+// Give up the address 'kva' that kmap returned.
+//
+void
+kunmap(void *kva)
+{
+	int cpu = cpunum();
+	uintptr_t va = (uintptr_t) kva;
+
+	if (va < KMAPBASE)
+		return;
+	assert(kmap_depth[cpu] > 0);
+	assert(va == KMAPBASE + (cpu * KMAP_SLOTS + kmap_depth[cpu] - 1) * PGSIZE);
+	kmap_ptes[PTX(va)] = 0;
+	invlpg(kva);
+	kmap_depth[cpu]--;
+}
+
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy
+// allocator: a free block of 2^k pages sits on free_area[k], and a
+// freed block is merged with its buddy (the other half of the block of
+// 2^(k+1) pages it belongs to) whenever that buddy is free too.
+// Memory the buddy allocator has not needed yet stays in page_extents.
 // --------------------------------------------------------------
 
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the free_area lists.
 //
 void
 page_init(void)
@@ -339,40 +548,165 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-	size_t i;
-	for (i = 0; i < npages; i++) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
-//	    }
+	size_t kern_end, end, i;
+	int k;
+
+	//  1) Physical page 0 is in use.
+	//  2) The rest of base memory is free, except (LAB 4) the page
+	//     at MPENTRY_PADDR.
+	//  3) The IO hole and 4) the kernel and everything boot_alloc
+	//     handed out are in use; the rest of extended memory is free.
+	//  High memory is all free, but it is not for the buddy allocator
+	//  (see page_alloc_high).
+	kern_end = PGNUM(PADDR(ROUNDUP(boot_alloc(0), PGSIZE)));
+	page_extent_add(1, PGNUM(MPENTRY_PADDR));
+	page_extent_add(PGNUM(MPENTRY_PADDR) + 1, npages_basemem);
+	page_extent_add(kern_end, npages_low);
+	page_high_next = npages_low;
+
+	// The PageInfo of every low page that is not free is valid from
+	// now on; the free ones get theirs when they are carved.
+	for (i = 0, k = 0; k <= npage_extents; k++) {
+		end = k < npage_extents ? page_extents[k].pe_start : npages_low;
+		page_meta_clear(i, end);
+		if (k < npage_extents)
+			i = page_extents[k].pe_end;
 	}
-	//  1) Mark physical page 0 as in use.
-	pages[1].pp_link = pages[0].pp_link;
-	//  2) The rest of base memory, [PGSIZE, npages_basemem * PGSIZE)
-	//     is free.
 
+	// Only carve what entry_pgdir maps for now.  mem_init lifts the
+	// limit once kern_pgdir is loaded.
+	page_extent_limit = MIN(npages_low, PGNUM(EARLYMEM));
+}
 
-	// LAB 4:
-	// Change your code to mark the physical page at MPENTRY_PADDR
-	// as in use
-	// Remember - pages[i+1].pp_link = pages[i]
-	// while pages[i] is unused :)
-	pages[(MPENTRY_PADDR/PGSIZE) + 1].pp_link =
-			pages[MPENTRY_PADDR/PGSIZE ].pp_link;
+// Reset all metadata of pages [start, end).
+static void
+page_meta_clear(size_t start, size_t end)
+{
+	memset(&pages[start], 0, (end - start) * sizeof(struct PageInfo));
+	memset(&page_links[start], 0, (end - start) * sizeof(struct PageLink));
+	memset(&page_nptes[start], 0, (end - start) * sizeof(uint16_t));
+	memset(&page_rmaps[start], 0, (end - start) * sizeof(union PageRmap));
+}
 
-	//  3) Then comes the IO hole [IOPHYSMEM, EXTPHYSMEM), which must
-	//     never be allocated.
-	//	EXTPHYSMEM	0x100000
-	//	IOPHYSMEM	0x0A0000
-	pages[EXTPHYSMEM/PGSIZE].pp_link = pages[IOPHYSMEM/PGSIZE].pp_link;
+// Record [start, end) as free memory not yet known to the buddy
+// allocator.  Extents must be added in ascending order.
+static void
+page_extent_add(size_t start, size_t end)
+{
+	end = MIN(end, npages_low);
+	if (start >= end)
+		return;
+	if (npage_extents == PAGE_EXTENT_MAX)
+		panic("page_extent_add: too many holes in physical memory");
+	assert(!npage_extents || page_extents[npage_extents - 1].pe_end <= start);
+	page_extents[npage_extents].pe_start = start;
+	page_extents[npage_extents].pe_end = end;
+	npage_extents++;
+}
 
-	//  4) Then extended memory [EXTPHYSMEM, ...).
-	// Until latest used which was allocated by boot_alloc()
-	char *nextfree = boot_alloc(0);
-	size_t kernel_pages =
-			(ROUNDUP((uint32_t)(nextfree - KERNBASE),PGSIZE))/PGSIZE;
-	pages[kernel_pages].pp_link = pages[EXTPHYSMEM/PGSIZE].pp_link;
+// True if page number 'pn' is free memory that has not been carved.
+static bool
+page_extent_holds(size_t pn)
+{
+	int k;
+
+	for (k = 0; k < npage_extents; k++)
+		if (pn >= page_extents[k].pe_start && pn < page_extents[k].pe_end)
+			return 1;
+	return 0;
+}
+
+// Move the largest naturally aligned block at the start of the lowest
+// extent onto the buddy lists.  Returns false if there is nothing left
+// to carve below page_extent_limit.
+static bool
+page_extent_carve(void)
+{
+	struct PageExtent *pe = &page_extents[0];
+	size_t start, end;
+	int order;
+
+	if (!npage_extents || page_extents_frozen)
+		return 0;
+	start = pe->pe_start;
+	end = MIN(pe->pe_end, page_extent_limit);
+	if (start >= end)
+		return 0;
+
+	for (order = PAGE_MAX_ORDER; order > 0; order--)
+		if ((start & ((1 << order) - 1)) == 0
+		    && start + (1 << order) <= end)
+			break;
+	if ((pe->pe_start += 1 << order) == pe->pe_end)
+		memmove(pe, pe + 1, --npage_extents * sizeof(*pe));
+
+	page_meta_clear(start, start + (1 << order));
+	page_free_order(&pages[start], order);
+	return 1;
+}
 
+// Number of free pages that have not been carved yet.
+size_t
+page_extent_pages(void)
+{
+	size_t n = 0;
+	int k;
+
+	for (k = 0; k < npage_extents; k++)
+		n += page_extents[k].pe_end - page_extents[k].pe_start;
+	return n;
+}
+
+// Number of free pages of high memory.
+size_t
+page_high_pages(void)
+{
+	return npages - page_high_next + page_high_nfree;
+}
+
+// Put the block of 2^order pages starting at 'pp' at the head of
+// free_area[order].
+static void
+free_area_push(struct PageInfo *pp, int order)
+{
+	struct FreeArea *fa = &free_area[order];
+
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	PP_PREV(pp) = NULL;
+	PP_LINK(pp) = fa->fa_head;
+	if (fa->fa_head)
+		PP_PREV(fa->fa_head) = pp;
+	fa->fa_head = pp;
+	fa->fa_nfree++;
+}
+
+// Take the free block starting at 'pp' off its free list.
+static void
+free_area_remove(struct PageInfo *pp)
+{
+	struct FreeArea *fa = &free_area[pp->pp_order];
+
+	if (PP_PREV(pp))
+		PP_LINK(PP_PREV(pp)) = PP_LINK(pp);
+	else
+		fa->fa_head = PP_LINK(pp);
+	if (PP_LINK(pp))
+		PP_PREV(PP_LINK(pp)) = PP_PREV(pp);
+	PP_LINK(pp) = PP_PREV(pp) = NULL;
+	pp->pp_flags &= ~PP_FREE;
+	fa->fa_nfree--;
+}
+
+// Refill the empty magazine 'pm' from the buddy allocator, as far as
+// free memory goes.
+static void
+page_mag_fill(struct PageMagazine *pm)
+{
+	struct PageInfo *pp;
+
+	while (pm->pm_count < PAGE_MAG_BATCH && (pp = page_alloc_order(0, 0)))
+		pm->pm_pages[pm->pm_count++] = pp;
 }
 
 //
@@ -381,24 +715,159 @@ page_init(void)
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
+// With ALLOC_HIGHMEM, the page may be high memory, which has no kernel
+// address: page2kva must not be used on it (see kmap).  It is taken
+// from high memory first, so that low memory stays for the kernel.
+//
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	// Fill this function in
-	if(! page_free_list){
+	struct PageMagazine *pm = &page_mags[cpunum()];
+	struct PageInfo *pp;
+	void *kva;
+
+	if ((alloc_flags & ALLOC_ZERO) && zero_pool) {
+		page_zero_stats.pz_hits++;
+		return zero_pool_take();
+	}
+
+	if ((alloc_flags & ALLOC_HIGHMEM) && (pp = page_alloc_high()))
+		goto high;
+
+	if (!pm->pm_count) {
+		page_mag_fill(pm);
+		// The zeroed pool is the last free memory there is, short
+		// of compressing user pages.
+		if (!pm->pm_count && zero_pool)
+			return zero_pool_take();
+		if (!pm->pm_count) {
+			// Pages it evicts from high memory go back to their
+			// own free list; low ones may have gone to the
+			// buddy allocator if the magazine filled up.
+			zram_reclaim(PAGE_MAG_BATCH);
+			if ((alloc_flags & ALLOC_HIGHMEM)
+			    && (pp = page_alloc_high()))
+				goto high;
+			if (!pm->pm_count)
+				page_mag_fill(pm);
+		}
+		if (!pm->pm_count)
+			return NULL;
+	}
+	pp = pm->pm_pages[--pm->pm_count];
+
+	if (alloc_flags & ALLOC_ZERO) {
+		page_zero_stats.pz_misses++;
+		memset(page2kva(pp), '\0', PGSIZE);
+	}
+	return pp;
+
+high:
+	if (alloc_flags & ALLOC_ZERO) {
+		page_zero_stats.pz_misses++;
+		kva = kmap(pp);
+		memset(kva, '\0', PGSIZE);
+		kunmap(kva);
+	}
+	return pp;
+}
+
+// Take a free page of high memory, or return NULL if there is none.
+static struct PageInfo *
+page_alloc_high(void)
+{
+	struct PageInfo *pp;
+
+	if ((pp = page_high_free)) {
+		page_high_free = PP_LINK(pp);
+		page_high_nfree--;
+	} else if (page_high_next < npages) {
+		pp = &pages[page_high_next];
+		page_meta_clear(page_high_next, page_high_next + 1);
+		page_high_next++;
+	}
+	if (pp)
+		PP_LINK(pp) = NULL;
+	return pp;
+}
+
+// Take a page off the zeroed pool, which must not be empty.
+static struct PageInfo *
+zero_pool_take(void)
+{
+	struct PageInfo *pp = zero_pool;
+
+	zero_pool = PP_LINK(pp);
+	PP_LINK(pp) = NULL;
+	page_zero_stats.pz_pooled--;
+	return pp;
+}
+
+//
+// Top up the zeroed pool, a few pages at a time.  Called by CPUs that
+// have nothing better to do (sched_halt), with the kernel lock held.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < PAGE_ZERO_BATCH; i++) {
+		if (page_zero_stats.pz_pooled >= PAGE_ZERO_POOL_MAX)
+			break;
+		if (!(pp = page_alloc_order(0, 0)))
+			break;
+		memset(page2kva(pp), '\0', PGSIZE);
+		PP_LINK(pp) = zero_pool;
+		zero_pool = pp;
+		page_zero_stats.pz_pooled++;
+		page_zero_stats.pz_zeroed++;
+	}
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// and returns the PageInfo of the first one.  ALLOC_ZERO zeroes all of
+// them.  As with page_alloc, no reference counts are touched; free the
+// block with page_free_order and the same order.
+//
+// Returns NULL if no free block is large enough.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int k;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
 		return NULL;
+
+	// Take the smallest free block that is large enough, carving
+	// fresh memory if there is none ...
+	for (;;) {
+		for (k = order; k <= PAGE_MAX_ORDER && !free_area[k].fa_head; k++)
+			;
+		if (k <= PAGE_MAX_ORDER)
+			break;
+		if (!page_extent_carve())
+			return NULL;
 	}
-	struct PageInfo * page = page_free_list;
-	page_free_list=page->pp_link;
-	uint32_t* page_kva = page2kva(page);
-	if(alloc_flags & ALLOC_ZERO){
-		memset(page_kva,'\0',PGSIZE);
+	pp = free_area[k].fa_head;
+	free_area_remove(pp);
+
+	// ... and split it, giving the upper halves back.
+	while (k > order) {
+		k--;
+		free_area_push(pp + (1 << k), k);
 	}
-	return page;
-//	return 0;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), '\0', PGSIZE << order);
+	return pp;
 }
 
 //
@@ -408,9 +877,82 @@ page_alloc(int alloc_flags)
 void
 page_free(struct PageInfo *pp)
 {
-	// Fill this function in
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	struct PageMagazine *pm = &page_mags[cpunum()];
+	int i;
+
+	if (pp->pp_ref)
+		panic("page_free: page %08x still has %d references",
+		      page2pa(pp), pp->pp_ref);
+	if (PP_RMAP(pp))
+		panic("page_free: page %08x is still mapped", page2pa(pp));
+	if (page_is_high(pp)) {
+		PP_LINK(pp) = page_high_free;
+		page_high_free = pp;
+		page_high_nfree++;
+		return;
+	}
+	if (pm->pm_count == PAGE_MAG_SIZE) {
+		// Drain the pages freed longest ago and keep the recent,
+		// likely cache-hot ones.
+		for (i = 0; i < PAGE_MAG_BATCH; i++)
+			page_free_order(pm->pm_pages[i], 0);
+		memmove(pm->pm_pages, pm->pm_pages + PAGE_MAG_BATCH,
+			(PAGE_MAG_SIZE - PAGE_MAG_BATCH) * sizeof(pm->pm_pages[0]));
+		pm->pm_count -= PAGE_MAG_BATCH;
+	}
+	pm->pm_pages[pm->pm_count++] = pp;
+}
+
+//
+// Return a block of 2^order pages obtained from page_alloc_order,
+// merging it with its buddy for as long as the buddy is free.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	size_t pn = pp - pages, buddy;
+
+	if (pp->pp_ref)
+		panic("page_free: page %08x still has %d references",
+		      page2pa(pp), pp->pp_ref);
+	if (pp->pp_flags & PP_FREE)
+		panic("page_free: page %08x is already free", page2pa(pp));
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	assert((pn & ((1 << order) - 1)) == 0);
+
+	while (order < PAGE_MAX_ORDER) {
+		buddy = pn ^ (1 << order);
+		if (buddy >= npages_low || page_extent_holds(buddy)
+		    || !(pages[buddy].pp_flags & PP_FREE)
+		    || pages[buddy].pp_order != order)
+			break;
+		free_area_remove(&pages[buddy]);
+		pn &= ~(1 << order);
+		order++;
+	}
+	free_area_push(&pages[pn], order);
+}
+
+//
+// Return the number of free blocks of 2^order pages.
+//
+size_t
+page_free_blocks(int order)
+{
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return 0;
+	return free_area[order].fa_nfree;
+}
+
+//
+// Return the number of free pages cached in CPU 'cpu's magazine.
+//
+size_t
+page_mag_pages(int cpu)
+{
+	if (cpu < 0 || cpu >= NCPU)
+		return 0;
+	return page_mags[cpu].pm_count;
 }
 
 //
@@ -420,6 +962,8 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
+	if (pp == zero_page)
+		return;
 	if (--pp->pp_ref == 0)
 		page_free(pp);
 }
@@ -446,6 +990,10 @@ page_decref(struct PageInfo* pp)
 // Hint 3: look at inc/mmu.h for useful macros that mainipulate page
 // table and page directory entries.
 //
+// If 'va' lies in a 4MB page (PTE_PS), there is no page table and
+// pgdir_walk returns a pointer to the page directory entry itself;
+// callers that care must check PTE_PS.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -453,6 +1001,18 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	physaddr_t pageTableBasePA = 0;
 	uint32_t PDe = pgdir[PDX(va)];
 	bool pageTableExists = (bool)(PDe & PTE_P);
+	// A 4MB page has no page table: the PDE is the entry that maps va
+	if (pageTableExists && (PDe & PTE_PS)){
+		return &pgdir[PDX(va)];
+	}
+	// Whoever asks for the page table to be created may write to
+	// it: one that fork shares becomes private first.
+	if (pageTableExists && create && !(PDe & PTE_W)){
+		if (pgtable_unshare(pgdir, va) < 0){
+			return NULL;
+		}
+		PDe = pgdir[PDX(va)];
+	}
 	if (pageTableExists){
 		pageTableBasePA = PTE_ADDR(PDe);
 	}else{
@@ -464,6 +1024,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 			return NULL;
 		}
 		++(newPage->pp_ref);
+		PP_NPTES(newPage) = 0;
+		PP_NPTES(pa2page(PADDR(pgdir)))++;
 		pageTableBasePA = page2pa(newPage) ;
 		pgdir[PDX(va)] = pageTableBasePA | PTE_SYSCALL;
 //		pgdir[PDX(va)] = pageTableBasePA | PTE_P;
@@ -479,6 +1041,13 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
 // Use permission bits perm|PTE_P for the entries.
 //
+// The mappings are marked PTE_G: they are the same in every address
+// space, so with CR4_PGE on they survive the TLB flush of an lcr3.
+//
+// Wherever va and pa are both 4MB-aligned and at least 4MB remain, a
+// single large (PTE_PS) page directory entry is used instead of a page
+// table.  That needs CR4_PSE, which entry.S sets.
+//
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
@@ -493,10 +1062,18 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	assert(PGOFF(pa) == 0);
 
 	while(size > 0) {
+		if (va % PTSIZE == 0 && pa % PTSIZE == 0 && size >= PTSIZE
+		    && !(pgdir[PDX(va)] & PTE_P)) {
+			pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS | PTE_G;
+			va += PTSIZE;
+			pa += PTSIZE;
+			size -= PTSIZE;
+			continue;
+		}
 		pte_t * temp = pgdir_walk(pgdir, (const void*)va, 1);
 		if (temp == NULL)
 			panic("boot_map_region: pgdir_walk failed");
-		*temp = PTE_ADDR(pa) | perm | PTE_P;
+		*temp = PTE_ADDR(pa) | perm | PTE_P | PTE_G;
 		va += PGSIZE;
 		pa += PGSIZE;
 		size -= PGSIZE;
@@ -533,11 +1110,29 @@ int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	// Fill this function in
-	pde_t * pPageTableEntry = pgdir_walk(pgdir,va,(int)true);
+	pde_t * pPageTableEntry;
+	struct PageInfo * pPageTable;
+	// Take the reference first: allocating the page table may
+	// compress away pages with a single reference (kern/zram.c).
+	if (pp != zero_page)
+		++(pp->pp_ref);
+	if (rmap_add(pp, pgdir, (uintptr_t) va) < 0) {
+		if (pp != zero_page)
+			--(pp->pp_ref);
+		return -E_NO_MEM;
+	}
+	pPageTableEntry = pgdir_walk(pgdir,va,(int)true);
 	if (!pPageTableEntry){
+		rmap_del(pp, pgdir, (uintptr_t) va);
+		if (pp != zero_page)
+			--(pp->pp_ref);
 		return -E_NO_MEM;
 	}
-	++(pp->pp_ref);
+	// Count the new entry first, so that page_remove of the old one
+	// cannot free the page table we are about to write into.
+	if ((pPageTable = pgtable_page(pgdir, va)))
+		++PP_NPTES(pPageTable);
+	// pgdir_walk gave us a private page table, so this cannot fail.
 	page_remove(pgdir,va);//Will not Deallocate the pp since pp_ref > 0
 	*pPageTableEntry = PTE_ADDR(page2pa(pp)) | perm | PTE_P;
 //	pgdir[PDX(va)] = PTE_ADDR(pgdir[PDX(va)])| perm | PTE_P;
@@ -562,7 +1157,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
 	// Fill this function in
 	struct PageInfo * PageDescriptor = NULL;
-	pde_t * pPageTableEntryVA = pgdir_walk(pgdir,va,(int)true);
+	pde_t * pPageTableEntryVA = pgdir_walk(pgdir,va,(int)false);
 	if (!pPageTableEntryVA) {
 		return NULL;
 	}
@@ -570,7 +1165,10 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 		*pte_store = pPageTableEntryVA;
 	}
 
-	if((*pPageTableEntryVA) & PTE_P){//Physical page is present (allocated)
+	if((*pPageTableEntryVA) & PTE_PS){//Part of a 4MB page
+		PageDescriptor = pa2page(PDE_LARGE_ADDR(*pPageTableEntryVA)
+					 + ((uintptr_t)va & (PTSIZE - PGSIZE)));
+	} else if((*pPageTableEntryVA) & PTE_P){//Physical page is present (allocated)
 		PageDescriptor = pa2page(PTE_ADDR(*pPageTableEntryVA));
 	}
 	return PageDescriptor;
@@ -579,6 +1177,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// Returns 0, or -E_NO_MEM if the page table that maps 'va' is shared by
+// fork and there is no memory for a copy; nothing is unmapped then.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -587,37 +1187,468 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //     (if such a PTE exists)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
+//   - A swapped-out entry (PTE_SWAP) is dropped as well, and the
+//     compressed copy of the page with it.
+//   - A user page table (below UTOP in an env's page directory) is
+//     freed along with its last mapping.  kern_pgdir keeps its page
+//     tables: the kernel half is shared by every env.
 //
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+int
 page_remove(pde_t *pgdir, void *va)
 {
 	// Fill this function in
 	pde_t * pPTe = NULL;
-	struct PageInfo * pPageDescriptor = page_lookup(pgdir,va,&pPTe);
-	if (!pPageDescriptor){
+	struct PageInfo * pPageDescriptor;
+	struct PageInfo * pPageTable;
+	if (pgtable_unshare(pgdir, va) < 0)
+		return -E_NO_MEM;
+	pPageDescriptor = page_lookup(pgdir,va,&pPTe);
+	if (pPageDescriptor){
+		assert(*pPTe & PTE_P);
+		*pPTe = 0;
+		tlb_invalidate(pgdir,va);
+		rmap_del(pPageDescriptor, pgdir, (uintptr_t) va);
+		page_decref(pPageDescriptor);
+	} else if (pPTe && PTE_SWAPPED(*pPTe)) {
+		zram_drop(*pPTe);
+		*pPTe = 0;
+		// Nothing was cached for the page itself, but CPUs may
+		// still hold the PDE, which is cleared below.
+		tlb_invalidate(pgdir,va);
+	} else {
+		return 0;
+	}
+
+	pPageTable = pgtable_page(pgdir, va);
+	if (!pPageTable || --PP_NPTES(pPageTable) > 0)
+		return 0;
+	if (pgdir == kern_pgdir || (uintptr_t) va >= UTOP)
+		return 0;
+	// The invalidation above (on either path) also dropped the
+	// cached PDE for va, so no CPU walks the page table after this.
+	pgdir[PDX(va)] = 0;
+	PP_NPTES(pa2page(PADDR(pgdir)))--;
+	page_decref(pPageTable);
+	return 0;
+}
+
+//
+// If 'va' maps a page copy-on-write -- the zero page, a page merged by
+// kern/ksm.c, or a page shared by fork -- give it a private, writable
+// copy.  Called on the first write, before the env's own fault handler
+// would see the fault.  A page nobody else maps any more is simply made
+// writable again.  A page table shared by fork is unshared first.
+//
+// Returns 1 if 'va' is now writable by the env (perhaps it already
+// was, and the write fault came from a stale TLB entry), 0 if it is
+// not mapped or is read-only, -E_NO_MEM if out of memory.
+//
+int
+page_unshare(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *old;
+	pte_t *pte;
+	void *dst, *src;
+	int perm, r;
+
+	if ((r = pgtable_unshare(pgdir, va)) < 0)
+		return r;
+	if (!(old = page_lookup(pgdir, va, &pte)))
+		return 0;
+	if (!(*pte & PTE_COW))
+		return (uintptr_t) va < UTOP
+			&& (*pte & (PTE_W | PTE_U)) == (PTE_W | PTE_U);
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (old != zero_page && !(old->pp_flags & PP_KSM)
+	    && old->pp_ref == 1) {
+		*pte = page2pa(old) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 1;
+	}
+	if (!(pp = page_alloc(ALLOC_HIGHMEM
+			      | (old == zero_page ? ALLOC_ZERO : 0))))
+		return -E_NO_MEM;
+	if (old != zero_page) {
+		dst = kmap(pp);
+		src = kmap(old);
+		memcpy(dst, src, PGSIZE);
+		kunmap(src);
+		kunmap(dst);
+	}
+	if (old->pp_flags & PP_KSM)
+		ksm_stats.ks_unmerged++;
+	if (page_insert(pgdir, pp, ROUNDDOWN(va, PGSIZE), perm) < 0) {
+		page_free(pp);
+		return -E_NO_MEM;
+	}
+	return 1;
+}
+
+// --------------------------------------------------------------
+// Page tables shared by fork.
+//
+// sys_fork does not copy the parent's page tables: the child's page
+// directory points at them too, and both page directory entries lose
+// PTE_W, so neither env can write through them.  The page table's
+// pp_ref counts the page directories that use it and its reverse map
+// lists them.  Shared page tables hold no swap cookies, and
+// kern/zram.c and kern/ksm.c leave them alone.
+//
+// The first write through a shared page table, by the env or by the
+// kernel on its behalf, gives the writer a copy of its own
+// (pgdir_walk, page_remove and page_unshare call pgtable_unshare).
+// Every page mapped there gains a reference, and writable pages become
+// copy-on-write in both copies.  A fork thus costs one page directory,
+// and each 4MB region costs a page table copy only once it is written.
+// --------------------------------------------------------------
+
+static int
+pgtable_other_one(pde_t *pgdir, uintptr_t va, void *arg)
+{
+	pde_t **pgdirs = arg;
+
+	if (pgdir == pgdirs[0])
+		return 0;
+	pgdirs[1] = pgdir;
+	return 1;
+}
+
+// A page directory other than 'pgdir' that uses the page table 'pt'.
+static pde_t *
+pgtable_other(struct PageInfo *pt, pde_t *pgdir)
+{
+	pde_t *pgdirs[2] = { pgdir, NULL };
+
+	rmap_walk(pt, pgtable_other_one, pgdirs);
+	assert(pgdirs[1]);
+	return pgdirs[1];
+}
+
+//
+// Let 'dst' use the page table that maps 'va' in 'src', read-only in
+// both, for fork.  'dst' must have no page table there yet.  Pages of
+// the table that were compressed away are brought back first.  The
+// caller flushes the TLB of 'src', which may still allow writes.
+//
+// Returns 0 on success (or if 'src' has no page table there),
+// -E_NO_MEM if out of memory.
+//
+int
+pgtable_share(pde_t *dst, pde_t *src, uintptr_t va)
+{
+	pde_t pde = src[PDX(va)];
+	struct PageInfo *pt;
+	pte_t *ptes;
+	int i, r;
+
+	va = ROUNDDOWN(va, PTSIZE);
+	assert(va < UTOP && !(dst[PDX(va)] & PTE_P));
+	if (!(pde & PTE_P) || (pde & PTE_PS))
+		return 0;
+	pt = pa2page(PTE_ADDR(pde));
+	if (pde & PTE_W) {
+		ptes = KADDR(PTE_ADDR(pde));
+		for (i = 0; i < NPTENTRIES; i++)
+			if (PTE_SWAPPED(ptes[i])
+			    && (r = zram_swap_in(src, va + i * PGSIZE)) < 0)
+				return r;
+		if (rmap_add(pt, src, va) < 0)
+			return -E_NO_MEM;
+	}
+	if (rmap_add(pt, dst, va) < 0) {
+		if (pde & PTE_W)
+			rmap_del(pt, src, va);
+		return -E_NO_MEM;
+	}
+	pt->pp_ref++;
+	src[PDX(va)] = pde & ~PTE_W;
+	dst[PDX(va)] = pde & ~PTE_W;
+	PP_NPTES(pa2page(PADDR(dst)))++;
+	return 0;
+}
+
+//
+// Give 'pgdir' a page table of its own for 'va', if it shares one.
+// Returns 1 if it did, 0 if the page table (if any) was private,
+// -E_NO_MEM if out of memory.
+//
+int
+pgtable_unshare(pde_t *pgdir, const void *va)
+{
+	uintptr_t base = ROUNDDOWN((uintptr_t) va, PTSIZE);
+	pde_t pde = pgdir[PDX(va)];
+	struct PageInfo *pt, *npt, *pp;
+	pte_t *ptes, *nptes;
+	pde_t *other;
+	int i;
+
+	if (base >= UTOP || !(pde & PTE_P) || (pde & (PTE_PS | PTE_W)))
+		return 0;
+	pt = pa2page(PTE_ADDR(pde));
+	if (pt->pp_ref == 1) {
+		// The other envs have let go of it.
+		rmap_del(pt, pgdir, base);
+		pgdir[PDX(va)] = pde | PTE_W;
+		tlb_invalidate(pgdir, (void *) va);
+		return 1;
+	}
+
+	if (!(npt = page_alloc(0)))
+		return -E_NO_MEM;
+	other = pgtable_other(pt, pgdir);
+	ptes = KADDR(PTE_ADDR(pde));
+	nptes = page2kva(npt);
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (!(ptes[i] & PTE_P)) {
+			nptes[i] = ptes[i];
+			continue;
+		}
+		pp = pa2page(PTE_ADDR(ptes[i]));
+		rmap_move(pp, pgdir, other, base + i * PGSIZE);
+		if (rmap_add(pp, pgdir, base + i * PGSIZE) < 0)
+			goto fail;
+		if (pp != zero_page)
+			pp->pp_ref++;
+		if ((ptes[i] & PTE_W) && !(ptes[i] & PTE_SHARE))
+			ptes[i] = (ptes[i] & ~PTE_W) | PTE_COW;
+		nptes[i] = ptes[i];
+	}
+
+	npt->pp_ref = 1;
+	PP_NPTES(npt) = PP_NPTES(pt);
+	rmap_del(pt, pgdir, base);
+	pt->pp_ref--;
+	pgdir[PDX(va)] = page2pa(npt) | PTE_SYSCALL;
+	// Also drops any cached copy of the old page directory entry.
+	tlb_invalidate(pgdir, (void *) va);
+	return 1;
+
+fail:
+	while (--i >= 0) {
+		if (!(ptes[i] & PTE_P))
+			continue;
+		pp = pa2page(PTE_ADDR(ptes[i]));
+		rmap_del(pp, pgdir, base + i * PGSIZE);
+		if (pp != zero_page)
+			pp->pp_ref--;
+	}
+	page_free(npt);
+	return -E_NO_MEM;
+}
+
+//
+// Stop using the page table for 'va' in 'pgdir' if it is shared with
+// other page directories, for env_free: they keep it.  Returns 1 if
+// 'pgdir' let go of it, 0 if the page table (if any) is private.
+//
+int
+pgtable_drop(pde_t *pgdir, uintptr_t va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	struct PageInfo *pt;
+	pte_t *ptes;
+	pde_t *other;
+	int i;
+
+	va = ROUNDDOWN(va, PTSIZE);
+	if (va >= UTOP || !(pde & PTE_P) || (pde & (PTE_PS | PTE_W)))
+		return 0;
+	pt = pa2page(PTE_ADDR(pde));
+	rmap_del(pt, pgdir, va);
+	if (pt->pp_ref == 1) {
+		pgdir[PDX(va)] = pde | PTE_W;
+		return 0;
+	}
+
+	other = pgtable_other(pt, pgdir);
+	ptes = KADDR(PTE_ADDR(pde));
+	for (i = 0; i < NPTENTRIES; i++)
+		if (ptes[i] & PTE_P)
+			rmap_move(pa2page(PTE_ADDR(ptes[i])), pgdir, other,
+				  va + i * PGSIZE);
+	pgdir[PDX(va)] = 0;
+	PP_NPTES(pa2page(PADDR(pgdir)))--;
+	pt->pp_ref--;
+	return 1;
+}
+
+//
+// Return the PageInfo of the page table that maps 'va' in 'pgdir', or
+// NULL if there is none (or 'va' lies in a 4MB page).
+//
+static struct PageInfo *
+pgtable_page(pde_t *pgdir, const void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+
+	if (!(pde & PTE_P) || (pde & PTE_PS))
+		return NULL;
+	return pa2page(PTE_ADDR(pde));
+}
+
+//
+// Return the number of pages spent on paging structures for the user
+// half of 'pgdir': the page directory and its page tables below UTOP.
+//
+size_t
+pgdir_pgtable_pages(pde_t *pgdir)
+{
+	return 1 + PP_NPTES(pa2page(PADDR(pgdir)));
+}
+
+// --------------------------------------------------------------
+// Cross-CPU TLB shootdown.
+//
+// Every CPU records the page directory it has loaded in cpu_pgdir
+// (always updated with the big kernel lock held).  When a mapping
+// changes, tlb_invalidate() queues the address for every other CPU
+// that may cache it, and tlb_flush_remote() hands each of them the
+// list in its mailbox, sends it a T_TLBFLUSH IPI and waits until it
+// has flushed.  Between tlb_batch_begin() and tlb_batch_end() the
+// addresses are only queued, so unmapping a whole range costs one
+// IPI round per CPU rather than one per page.  Past TLB_BATCH_MAX
+// addresses the targets flush their whole TLB instead.
+//
+// The sender holds the big kernel lock while it waits, so a CPU
+// spinning for the lock keeps serving its mailbox (see spin_lock),
+// and a halted CPU serves it from the IPI without taking the lock.
+// --------------------------------------------------------------
+
+#define TLB_BATCH_MAX	32
+
+// Addresses queued by the lock holder.
+static struct {
+	int tb_depth;			// Nesting of tlb_batch_begin
+	uint32_t tb_cpus;		// CPUs to send the batch to
+	bool tb_global;			// Batch includes kernel addresses
+	int tb_nva;			// Queued addresses, may exceed max
+	uintptr_t tb_va[TLB_BATCH_MAX];
+} tlb_batch;
+
+// One mailbox per receiving CPU.
+static struct TlbMailbox {
+	volatile uint32_t tm_pending;
+	bool tm_global;
+	int tm_nva;
+	uintptr_t tm_va[TLB_BATCH_MAX];
+} tlb_mailbox[NCPU];
+
+static void tlb_flush_remote(void);
+
+// Start queueing TLB shootdowns instead of sending them one by one.
+// Pages unmapped inside a batch may still be cached by other CPUs
+// until tlb_batch_end(), so they must not be reused before then.
+void
+tlb_batch_begin(void)
+{
+	tlb_batch.tb_depth++;
+}
+
+// Send the shootdowns queued since the outermost tlb_batch_begin().
+void
+tlb_batch_end(void)
+{
+	assert(tlb_batch.tb_depth > 0);
+	if (--tlb_batch.tb_depth == 0 && tlb_batch.tb_cpus)
+		tlb_flush_remote();
+}
+
+static void
+tlb_flush_remote(void)
+{
+	struct TlbMailbox *tm;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (!(tlb_batch.tb_cpus & (1 << i)))
+			continue;
+		tm = &tlb_mailbox[i];
+		tm->tm_global = tlb_batch.tb_global;
+		tm->tm_nva = tlb_batch.tb_nva;
+		memcpy(tm->tm_va, tlb_batch.tb_va,
+		       MIN(tlb_batch.tb_nva, TLB_BATCH_MAX) * sizeof(uintptr_t));
+		// The list must be complete before the target sees it.
+		asm volatile("" : : : "memory");
+		tm->tm_pending = 1;
+		lapic_ipi_dest(cpus[i].cpu_id, T_TLBFLUSH);
+	}
+	for (i = 0; i < ncpu; i++)
+		if (tlb_batch.tb_cpus & (1 << i))
+			while (tlb_mailbox[i].tm_pending)
+				asm volatile("pause");
+
+	tlb_batch.tb_cpus = 0;
+	tlb_batch.tb_global = 0;
+	tlb_batch.tb_nva = 0;
+}
+
+// Carry out the shootdown waiting in this CPU's mailbox, if any.
+// Called from the T_TLBFLUSH handler and while spinning for the big
+// kernel lock.
+void
+tlb_shootdown_handle(void)
+{
+	struct TlbMailbox *tm = &tlb_mailbox[cpunum()];
+	uint32_t cr4;
+	int i;
+
+	if (!tm->tm_pending)
 		return;
+	asm volatile("" : : : "memory");
+	if (tm->tm_nva > TLB_BATCH_MAX) {
+		// Too many to name; flush everything.  Global entries
+		// survive a cr3 reload, so toggle CR4.PGE for those.
+		cr4 = rcr4();
+		if (tm->tm_global && (cr4 & CR4_PGE)) {
+			lcr4(cr4 & ~CR4_PGE);
+			lcr4(cr4);
+		} else
+			lcr3(rcr3());
+	} else {
+		for (i = 0; i < tm->tm_nva; i++)
+			invlpg((void *) tm->tm_va[i]);
 	}
-	assert(*pPTe & PTE_P);
-	*pPTe = 0;
-	tlb_invalidate(pgdir,va);
-	page_decref(pPageDescriptor);
+	xchg(&tm->tm_pending, 0);
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Invalidate a TLB entry on every CPU that may cache it: this one if
+// the page tables being edited are the ones it has loaded, and any
+// other CPU using them (via an IPI, see above).
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	int i;
+
+	// Flush our own entry if we're modifying the current address
+	// space (or the kernel half, which every address space shares).
+	if ((uintptr_t) va >= UTOP || !thiscpu->cpu_pgdir
+	    || thiscpu->cpu_pgdir == pgdir)
 		invlpg(va);
+
+	// Other CPUs with 'pgdir' loaded must drop their entry too.
+	for (i = 0; i < ncpu; i++) {
+		if (&cpus[i] == thiscpu || !cpus[i].cpu_pgdir)
+			continue;
+		if ((uintptr_t) va >= UTOP || cpus[i].cpu_pgdir == pgdir)
+			tlb_batch.tb_cpus |= 1 << i;
+	}
+	if (!tlb_batch.tb_cpus)
+		return;
+	if ((uintptr_t) va >= UTOP)
+		tlb_batch.tb_global = 1;
+	if (tlb_batch.tb_nva < TLB_BATCH_MAX)
+		tlb_batch.tb_va[tlb_batch.tb_nva] = (uintptr_t) va;
+	tlb_batch.tb_nva++;
+	if (!tlb_batch.tb_depth)
+		tlb_flush_remote();
 }
 
+
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
 // location.  Return the base of the reserved region.  size does *not*
@@ -626,40 +1657,13 @@ tlb_invalidate(pde_t *pgdir, void *va)
 void *
 mmio_map_region(physaddr_t pa, size_t size)
 {
-	// Where to start the next region.  Initially, this is the
-	// beginning of the MMIO region.  Because this is static, its
-	// value will be preserved between calls to mmio_map_region
-	// (just like nextfree in boot_alloc).
-	static uintptr_t base = MMIOBASE;
-
-	// Reserve size bytes of virtual memory starting at base and
-	// map physical pages [pa,pa+size) to virtual addresses
-	// [base,base+size).  Since this is device memory and not
-	// regular DRAM, you'll have to tell the CPU that it isn't
-	// safe to cache access to this memory.  Luckily, the page
-	// tables provide bits for this purpose; simply create the
-	// mapping with PTE_PCD|PTE_PWT (cache-disable and
-	// write-through) in addition to PTE_W.  (If you're interested
-	// in more details on this, see section 10.5 of IA32 volume
-	// 3A.)
-	//
-	// Be sure to round size up to a multiple of PGSIZE and to
-	// handle if this reservation would overflow MMIOLIM (it's
-	// okay to simply panic if this happens).
-	//
-	// Hint: The staff solution uses boot_map_region.
-	//
-	// Your code here:
-	void * ret = (void*)base;
-	size_t actual_size = ROUNDUP(size,PGSIZE);
-	if (base + actual_size > MMIOLIM ||
-			base + actual_size  < base){
+	// The MMIO region is ioremap's arena now, which can also give
+	// regions back (see kern/vmalloc.c).
+	void * ret = ioremap(pa, size, VM_CACHE_UC);
+	if (!ret){
 		panic("mmio_map_region - rounded up size exceeds MMIOLIM ");
 	}
-	boot_map_region(kern_pgdir, base, actual_size, pa, PTE_PCD|PTE_PWT|PTE_W);
-	base+=actual_size;
 	return ret;
-	panic("mmio_map_region not implemented");
 }
 
 static uintptr_t user_mem_check_addr;
@@ -679,50 +1683,76 @@ static uintptr_t user_mem_check_addr;
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
+// The kernel is about to touch the memory on the env's behalf, so pages
+// of the program image not touched yet are paged in, and if 'perm' has
+// PTE_W, copy-on-write pages (and page tables shared by fork) are
+// copied, as the env's own accesses would.
+//
 // Returns 0 if the user program can access this range of addresses,
-// and -E_FAULT otherwise.
+// -E_NO_MEM if it could but there is no memory to page it in or copy
+// it, and -E_FAULT otherwise.
 //
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here.
 
-	int i;
-	perm |= PTE_P;
+	uintptr_t a = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	uintptr_t end = (uintptr_t) va + len;
 	pte_t *pte;
-	for(i = 0; i < len; i++) {
-		if((uintptr_t)(va + i) > ULIM) {
-			user_mem_check_addr = (uintptr_t)(va + i);
-			return -E_FAULT;
-		}
-		pte = pgdir_walk(env->env_pgdir, (void *)(va + i), 0);
-		if (pte == NULL) {
-			user_mem_check_addr = (uintptr_t)(va + i);
-			return -E_FAULT;
+	int r;
+
+	perm |= PTE_P;
+	if (end < (uintptr_t) va)
+		end = ~(uintptr_t) 0;
+	for (; a < end; a += PGSIZE) {
+		r = -E_FAULT;
+		if (a >= ULIM)
+			goto fail;
+		pte = pgdir_walk(env->env_pgdir, (void *) a, 0);
+		if (!pte || !(*pte & PTE_P)) {
+			if ((r = env_demand_page(env, a, perm & PTE_W))
+			    == -E_NO_MEM)
+				goto fail;
+			pte = pgdir_walk(env->env_pgdir, (void *) a, 0);
 		}
-		if ((*pte & perm) != perm) {
-			user_mem_check_addr = (uintptr_t)(va + i);
-			return -E_FAULT;
+		if (pte && (*pte & PTE_P) && (perm & PTE_W)
+		    && !(*pte & env->env_pgdir[PDX(a)] & PTE_W)) {
+			if ((r = page_unshare(env->env_pgdir, (void *) a)) < 0)
+				goto fail;
+			pte = pgdir_walk(env->env_pgdir, (void *) a, 0);
 		}
+		r = -E_FAULT;
+		if (!pte || (*pte & perm) != perm)
+			goto fail;
 	}
 	return 0;
+
+fail:
+	user_mem_check_addr = MAX(a, (uintptr_t) va);
+	return r;
 }
 
 //
 // Checks that environment 'env' is allowed to access the range
 // of memory [va, va+len) with permissions 'perm | PTE_U | PTE_P'.
-// If it can, then the function simply returns.
+// If it can, then the function returns 0.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// If there is no memory to page in or copy the range, the function
+// returns -E_NO_MEM and the env is left alone.
 //
-void
+int
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
+	int r;
+
+	if ((r = user_mem_check(env, va, len, perm | PTE_U)) == -E_FAULT) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
 		env_destroy(env);	// may not return
 	}
+	return r;
 }
 
 
@@ -730,67 +1760,177 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // Checking functions.
 // --------------------------------------------------------------
 
+// Check a page that is on a free list or in a magazine.
+static void
+check_free_page(struct PageInfo *pp, char *first_free_page,
+		int *nfree_basemem, int *nfree_extmem)
+{
+	// check a few pages that shouldn't be on the free list
+	assert(page2pa(pp) != 0);
+	assert(page2pa(pp) != IOPHYSMEM);
+	assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+	assert(page2pa(pp) != EXTPHYSMEM);
+	assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+	// (new test for lab 4)
+	assert(page2pa(pp) != MPENTRY_PADDR);
+
+	if (page2pa(pp) < EXTPHYSMEM)
+		++*nfree_basemem;
+	else
+		++*nfree_extmem;
+}
+
+// Check an extent of free pages that have not been carved yet.
+static void
+check_free_extent(struct PageExtent *pe, char *first_free_page,
+		  int *nfree_basemem, int *nfree_extmem)
+{
+	size_t nbase;
+
+	assert(pe->pe_start > 0);
+	assert(pe->pe_start < pe->pe_end && pe->pe_end <= npages);
+	assert(pe == page_extents || pe[-1].pe_end <= pe->pe_start);
+	// no IO hole or kernel memory ...
+	assert(pe->pe_end <= PGNUM(IOPHYSMEM)
+	       || (char *) KADDR(pe->pe_start << PGSHIFT) >= first_free_page);
+	// ... and no MPENTRY_PADDR (new test for lab 4)
+	assert(PGNUM(MPENTRY_PADDR) < pe->pe_start
+	       || PGNUM(MPENTRY_PADDR) >= pe->pe_end);
+
+	nbase = pe->pe_start < PGNUM(EXTPHYSMEM)
+		? MIN(pe->pe_end, PGNUM(EXTPHYSMEM)) - pe->pe_start : 0;
+	*nfree_basemem += nbase;
+	*nfree_extmem += pe->pe_end - pe->pe_start - nbase;
+}
+
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the free_area lists, in the per-CPU
+// magazines and in the uncarved extents are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *bp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	size_t nblocks, pn;
+	int order, cpu, i;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	if (!npage_extents && !free_area[0].fa_head
+	    && !free_area[PAGE_MAX_ORDER].fa_head)
+		panic("'free_area' is empty!");
+
+	// page_init frees only the pages entry_pgdir maps, so there is no
+	// need to move low pages to the front before kern_pgdir is loaded.
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (bp = free_area[order].fa_head; bp; bp = PP_LINK(bp))
+			for (pp = bp; pp < bp + (1 << order); pp++)
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
+	for (cpu = 0; cpu < NCPU; cpu++)
+		for (i = 0; i < page_mags[cpu].pm_count; i++) {
+			pp = page_mags[cpu].pm_pages[i];
+			if (PDX(page2pa(pp)) < pdx_limit)
+				memset(page2kva(pp), 0x97, 128);
+		}
+	// Uncarved memory only in the low 4MB, so that the check does
+	// not touch every page of a big machine.
+	for (i = 0; i < npage_extents; i++)
+		for (pn = page_extents[i].pe_start;
+		     pn < MIN(page_extents[i].pe_end, PGNUM(PTSIZE)); pn++)
+			memset(page2kva(&pages[pn]), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		nblocks = 0;
+		for (bp = free_area[order].fa_head; bp; bp = PP_LINK(bp)) {
+			// check that we didn't corrupt the free list itself
+			assert(bp >= pages);
+			assert(bp + (1 << order) <= pages + npages);
+			assert(((char *) bp - (char *) pages) % sizeof(*bp) == 0);
+			assert(((bp - pages) & ((1 << order) - 1)) == 0);
+			assert((bp->pp_flags & PP_FREE) && bp->pp_order == order);
+			assert(!PP_LINK(bp) || PP_PREV(PP_LINK(bp)) == bp);
+			++nblocks;
+
+			for (pp = bp; pp < bp + (1 << order); pp++)
+				check_free_page(pp, first_free_page,
+						&nfree_basemem, &nfree_extmem);
+		}
+		assert(nblocks == free_area[order].fa_nfree);
 	}
+	for (cpu = 0; cpu < NCPU; cpu++)
+		for (i = 0; i < page_mags[cpu].pm_count; i++) {
+			pp = page_mags[cpu].pm_pages[i];
+			assert(pp >= pages && pp < pages + npages);
+			assert(!(pp->pp_flags & PP_FREE));
+			check_free_page(pp, first_free_page,
+					&nfree_basemem, &nfree_extmem);
+		}
+	for (pp = zero_pool; pp; pp = PP_LINK(pp)) {
+		assert(pp >= pages && pp < pages + npages);
+		assert(!(pp->pp_flags & PP_FREE));
+		check_free_page(pp, first_free_page,
+				&nfree_basemem, &nfree_extmem);
+	}
+	for (i = 0; i < npage_extents; i++)
+		check_free_extent(&page_extents[i], first_free_page,
+				  &nfree_basemem, &nfree_extmem);
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
 }
 
+// Number of free pages, over all orders, magazines and extents.
+static size_t
+check_nfree_pages(void)
+{
+	size_t n = page_extent_pages();
+	int order, cpu;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		n += free_area[order].fa_nfree << order;
+	for (cpu = 0; cpu < NCPU; cpu++)
+		n += page_mags[cpu].pm_count;
+	return n + page_zero_stats.pz_pooled;
+}
+
+// Allocate every free page, for checks that need the allocator to be
+// empty.  The pages are chained through PP_LINK.  Memory that has not
+// been carved yet is only frozen, not carved and taken: that would
+// touch the PageInfo of every page in the machine.
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	page_extents_frozen = 1;
+	while ((pp = page_alloc(0))) {
+		PP_LINK(pp) = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+// Free the pages taken by check_steal_free_pages, in the reverse
+// order, so the lowest blocks end up first on the free lists again.
+static void
+check_return_free_pages(struct PageInfo *fl)
+{
+	struct PageInfo *pp;
+
+	while ((pp = fl)) {
+		fl = PP_LINK(pp);
+		PP_LINK(pp) = NULL;
+		page_free(pp);
+	}
+	page_extents_frozen = 0;
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -799,7 +1939,7 @@ static void
 check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	int nfree;
+	size_t nfree;
 	struct PageInfo *fl;
 	char *c;
 	int i;
@@ -808,8 +1948,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree_pages();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -825,8 +1964,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -854,7 +1992,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -862,13 +2000,54 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(check_nfree_pages() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check multi-page allocations (page_alloc_order(), page_free_order()).
+//
+static void
+check_page_alloc_order(void)
+{
+	struct PageInfo *pp0, *pp1, *pp2;
+	size_t nfree, nblocks[PAGE_MAX_ORDER + 1];
+	char *c;
+	int i;
+
+	nfree = check_nfree_pages();
+	for (i = 0; i <= PAGE_MAX_ORDER; i++)
+		nblocks[i] = page_free_blocks(i);
+
+	// blocks are aligned to their size and don't overlap
+	assert((pp0 = page_alloc_order(2, ALLOC_ZERO)));
+	assert(((pp0 - pages) & 3) == 0);
+	assert((pp1 = page_alloc_order(PAGE_MAX_ORDER, 0)));
+	assert(((pp1 - pages) & ((1 << PAGE_MAX_ORDER) - 1)) == 0);
+	assert(pp1 + (1 << PAGE_MAX_ORDER) <= pp0 || pp0 + 4 <= pp1);
+	assert((pp2 = page_alloc_order(0, 0)));
+	assert(pp2 < pp0 || pp2 >= pp0 + 4);
+	assert(pp2 < pp1 || pp2 >= pp1 + (1 << PAGE_MAX_ORDER));
+	assert(check_nfree_pages() == nfree - 4 - (1 << PAGE_MAX_ORDER) - 1);
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+
+	// ALLOC_ZERO clears the whole block
+	c = page2kva(pp0);
+	for (i = 0; i < 4 * PGSIZE; i++)
+		assert(c[i] == 0);
+
+	// freeing merges the blocks back with their buddies
+	page_free_order(pp2, 0);
+	page_free_order(pp0, 2);
+	page_free_order(pp1, PAGE_MAX_ORDER);
+	assert(check_nfree_pages() == nfree);
+	for (i = 0; i <= PAGE_MAX_ORDER; i++)
+		assert(page_free_blocks(i) == nblocks[i]);
+
+	cprintf("check_page_alloc_order() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly (by mem_init()).
@@ -896,7 +2075,7 @@ check_kern_pgdir(void)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
 	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE){
+	for (i = 0; i < npages_low * PGSIZE; i += PGSIZE){
 //		cprintf("\n i=====================> %d \n",i);
 //		cprintf("%x",ROUNDUP((0xFFFFFFFF - KERNBASE), PGSIZE));
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -912,6 +2091,12 @@ check_kern_pgdir(void)
 		for (i = 0; i < KSTKGAP; i += PGSIZE)
 			assert(check_va2pa(pgdir, base + i) == ~0);
 	}
+
+	// check kmap windows: a page table of their own, all unused
+	assert(!(pgdir[PDX(KMAPBASE)] & PTE_PS));
+	for (i = 0; i < NCPU * KMAP_SLOTS; i++)
+		assert(check_va2pa(pgdir, KMAPBASE + i * PGSIZE) == ~0);
+
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
 		switch (i) {
@@ -947,6 +2132,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_LARGE_ADDR(*pgdir) + (va & (PTSIZE - PGSIZE));
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -977,8 +2164,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1094,7 +2280,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1119,10 +2305,12 @@ check_page(void)
 	// check permissions
 	assert(*pgdir_walk(kern_pgdir, (void*) mm1, 0) & (PTE_W|PTE_PWT|PTE_PCD));
 	assert(!(*pgdir_walk(kern_pgdir, (void*) mm1, 0) & PTE_U));
-	// clear the mappings
-	*pgdir_walk(kern_pgdir, (void*) mm1, 0) = 0;
-	*pgdir_walk(kern_pgdir, (void*) mm1 + PGSIZE, 0) = 0;
-	*pgdir_walk(kern_pgdir, (void*) mm2, 0) = 0;
+	// give the regions back to ioremap's arena
+	iounmap((void *) mm1);
+	iounmap((void *) mm2);
+	assert(check_va2pa(kern_pgdir, mm1) == ~0);
+	assert(check_va2pa(kern_pgdir, mm1+PGSIZE) == ~0);
+	assert(check_va2pa(kern_pgdir, mm2) == ~0);
 
 	cprintf("check_page() succeeded!\n");
 }
@@ -1134,6 +2322,7 @@ check_page_installed_pgdir(void)
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	struct PageInfo *fl;
 	pte_t *ptep, *ptep1;
+	pde_t *pgdir;
 	uintptr_t va;
 	int i;
 
@@ -1166,5 +2355,24 @@ check_page_installed_pgdir(void)
 	// free the pages we took
 	page_free(pp0);
 
+	// a user page table goes away with its last mapping
+	assert((pp0 = page_alloc(ALLOC_ZERO)));
+	assert((pp1 = page_alloc(0)));
+	assert((pp2 = page_alloc(0)));
+	PP_NPTES(pp0) = 0;
+	pgdir = page2kva(pp0);
+	assert(page_insert(pgdir, pp1, (void*) PGSIZE, PTE_W) == 0);
+	assert(page_insert(pgdir, pp2, (void*) (2*PGSIZE), PTE_W) == 0);
+	assert(pgdir_pgtable_pages(pgdir) == 2);
+	pp = pa2page(PTE_ADDR(pgdir[0]));
+	assert(pp->pp_ref == 1 && PP_NPTES(pp) == 2);
+	page_remove(pgdir, (void*) PGSIZE);
+	assert((pgdir[0] & PTE_P) && PP_NPTES(pp) == 1);
+	page_remove(pgdir, (void*) (2*PGSIZE));
+	assert(pgdir[0] == 0 && pp->pp_ref == 0);
+	assert(pgdir_pgtable_pages(pgdir) == 1);
+	assert(pp1->pp_ref == 0 && pp2->pp_ref == 0);
+	page_free(pp0);
+
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
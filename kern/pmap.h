@@ -14,33 +14,67 @@ extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
+extern size_t npages_low;
+
+// The per-page metadata that is not in struct PageInfo, one array per
+// kind, indexed like pages[].
+struct PageLink {
+	// Next and previous page on the free list.  Only the first page
+	// of each free block of the buddy allocator is on a list.
+	struct PageInfo *pl_next;
+	struct PageInfo *pl_prev;
+};
+
+union PageRmap {
+	// The page table entries that map this page (kern/rmap.c).  The
+	// page directory of an env points back to the env instead.
+	struct RmapChunk *pr_chunks;
+	struct Env *pr_env;
+};
+
+extern struct PageLink *page_links;
+extern union PageRmap *page_rmaps;
+
+// For a page table or page directory in use, the number of its entries
+// that point to something: mapped pages for a page table, page tables
+// for a page directory.  See page_remove.  A page that holds compressed
+// pages (PP_ZRAM) counts those instead; swapped-out entries still count
+// in their page table.
+extern uint16_t *page_nptes;
+
+#define PP_LINK(pp)	(page_links[(pp) - pages].pl_next)
+#define PP_PREV(pp)	(page_links[(pp) - pages].pl_prev)
+#define PP_NPTES(pp)	(page_nptes[(pp) - pages])
+#define PP_RMAP(pp)	(page_rmaps[(pp) - pages].pr_chunks)
+#define PP_ENV(pp)	(page_rmaps[(pp) - pages].pr_env)
 
 extern pde_t *kern_pgdir;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
- * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
- * and returns the corresponding physical address.  It panics if you pass it a
- * non-kernel virtual address.
+ * KERNBASE, where the first 220MB of physical memory are mapped -- and returns
+ * the corresponding physical address.  It panics if you pass it a non-kernel
+ * virtual address, or one of vmalloc or kmap.
  */
 #define PADDR(kva) _paddr(__FILE__, __LINE__, kva)
 
 static inline physaddr_t
 _paddr(const char *file, int line, void *kva)
 {
-	if ((uint32_t)kva < KERNBASE)
+	if ((uint32_t)kva < KERNBASE || (uint32_t)kva >= VMALLOCBASE)
 		_panic(file, line, "PADDR called with invalid kva %08lx", kva);
 	return (physaddr_t)kva - KERNBASE;
 }
 
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address. */
+ * virtual address.  It panics if you pass an invalid physical address, or
+ * one in high memory (see kmap). */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PGNUM(pa) >= npages_low)
 		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
 	return (void *)(pa + KERNBASE);
 }
@@ -49,24 +83,67 @@ _kaddr(const char *file, int line, physaddr_t pa)
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// For page_alloc, the page may be high memory (see kmap).
+	ALLOC_HIGHMEM = 1<<1,
 };
 
+// kmap windows per CPU.
+#define KMAP_SLOTS	8
+
+// Largest block the buddy allocator manages: 2^PAGE_MAX_ORDER pages,
+// which is 4MB, one page table's worth.
+#define PAGE_MAX_ORDER	10
+
+// Pre-zeroed page pool counters (see page_zero_idle).
+struct PageZeroStats {
+	uint32_t pz_pooled;	// Pages in the pool now
+	uint32_t pz_zeroed;	// Pages zeroed by idle CPUs, ever
+	uint32_t pz_hits;	// ALLOC_ZERO requests served from the pool
+	uint32_t pz_misses;	// ALLOC_ZERO requests that had to memset
+};
+extern struct PageZeroStats page_zero_stats;
+
+// The shared zero page (see page_unshare), and the permissions to
+// map it with where 'perm' was asked for: a writable mapping becomes
+// copy-on-write.
+extern struct PageInfo *zero_page;
+#define ZERO_PAGE_PERM(perm) \
+	(((perm) & PTE_W) ? ((perm) & ~PTE_W) | PTE_COW : (perm))
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+size_t	page_free_blocks(int order);
+size_t	page_mag_pages(int cpu);
+size_t	page_extent_pages(void);
+size_t	page_high_pages(void);
+void	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
-void	page_remove(pde_t *pgdir, void *va);
+int	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+size_t	pgdir_pgtable_pages(pde_t *pgdir);
+int	page_unshare(pde_t *pgdir, void *va);
+int	pgtable_share(pde_t *dst, pde_t *src, uintptr_t va);
+int	pgtable_unshare(pde_t *pgdir, const void *va);
+int	pgtable_drop(pde_t *pgdir, uintptr_t va);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
+void	tlb_shootdown_handle(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
+void *	kmap(struct PageInfo *pp);
+void	kunmap(void *kva);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
-void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -88,6 +165,13 @@ page2kva(struct PageInfo *pp)
 	return KADDR(page2pa(pp));
 }
 
+// True if 'pp' is high memory, which only kmap can reach.
+static inline bool
+page_is_high(struct PageInfo *pp)
+{
+	return (size_t) (pp - pages) >= npages_low;
+}
+
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
 #endif /* !JOS_KERN_PMAP_H */
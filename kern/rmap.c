@@ -0,0 +1,212 @@
+// Reverse mapping: from a physical page to the page table entries that
+// map it.
+//
+// page_insert adds a (page directory, va) pair to the page's reverse
+// map and page_remove takes it off again, so every user of a page can
+// be found in time proportional to the number of its mappings instead
+// of by scanning every page directory.  Pairs are kept in small chunks
+// allocated from the "rmap" kmem cache: a page mapped n times costs
+// ceil(n / RMAP_CHUNK_SIZE) chunks.
+//
+// The shared zero page is not tracked: every env maps it and nobody
+// needs to find them all.  Neither are the boot-time mappings of the
+// kernel (boot_map_region) or the mappings made before rmap_init by
+// mem_init's self-tests.
+//
+// The page directory of an env points back to the env (PP_ENV), so
+// the env behind a mapping is found in constant time too.
+//
+// A page table that fork shares between page directories (see
+// pgtable_share) lists them in its own reverse map.  The pages it maps
+// are recorded once, under any one of those page directories.
+
+#include <inc/types.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/memlayout.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/rmap.h>
+
+static struct KmemCache *rmap_cache;
+
+void
+rmap_init(void)
+{
+	if (!(rmap_cache = kmem_cache_create("rmap", sizeof(struct RmapChunk),
+					     0, NULL)))
+		panic("rmap_init: out of memory");
+}
+
+//
+// Record that 'pgdir' maps 'pp' at 'va'.
+// Returns 0 on success, -E_NO_MEM if there is no memory for the record.
+//
+int
+rmap_add(struct PageInfo *pp, pde_t *pgdir, uintptr_t va)
+{
+	struct RmapChunk *rc;
+	int i;
+
+	if (!rmap_cache || pp == zero_page)
+		return 0;
+	for (rc = PP_RMAP(pp); rc; rc = rc->rc_next)
+		for (i = 0; i < RMAP_CHUNK_SIZE; i++)
+			if (!rc->rc_map[i].rm_pgdir)
+				goto found;
+
+	if (!(rc = kmem_cache_alloc(rmap_cache)))
+		return -E_NO_MEM;
+	memset(rc, 0, sizeof(*rc));
+	rc->rc_next = PP_RMAP(pp);
+	PP_RMAP(pp) = rc;
+	i = 0;
+found:
+	rc->rc_map[i].rm_pgdir = pgdir;
+	rc->rc_map[i].rm_va = ROUNDDOWN(va, PGSIZE);
+	return 0;
+}
+
+//
+// Forget that 'pgdir' maps 'pp' at 'va'.  A chunk is freed with its
+// last pair.
+//
+void
+rmap_del(struct PageInfo *pp, pde_t *pgdir, uintptr_t va)
+{
+	struct RmapChunk *rc, **prev;
+	int i, used;
+
+	if (!rmap_cache || pp == zero_page)
+		return;
+	va = ROUNDDOWN(va, PGSIZE);
+	for (prev = &PP_RMAP(pp); (rc = *prev); prev = &rc->rc_next) {
+		for (i = 0; i < RMAP_CHUNK_SIZE; i++)
+			if (rc->rc_map[i].rm_pgdir == pgdir
+			    && rc->rc_map[i].rm_va == va)
+				break;
+		if (i == RMAP_CHUNK_SIZE)
+			continue;
+		rc->rc_map[i].rm_pgdir = NULL;
+		for (used = 0, i = 0; i < RMAP_CHUNK_SIZE; i++)
+			used += rc->rc_map[i].rm_pgdir != NULL;
+		if (!used) {
+			*prev = rc->rc_next;
+			kmem_cache_free(rmap_cache, rc);
+		}
+		return;
+	}
+	// Mapped before rmap_init, as mem_init's self-tests do.
+}
+
+//
+// Record under 'to' the mapping of 'pp' at 'va' recorded under 'from',
+// if there is one.  For shared page tables, whose pages may be recorded
+// under any of the page directories that use them.
+//
+void
+rmap_move(struct PageInfo *pp, pde_t *from, pde_t *to, uintptr_t va)
+{
+	struct RmapChunk *rc;
+	int i;
+
+	if (!rmap_cache || pp == zero_page)
+		return;
+	va = ROUNDDOWN(va, PGSIZE);
+	for (rc = PP_RMAP(pp); rc; rc = rc->rc_next)
+		for (i = 0; i < RMAP_CHUNK_SIZE; i++)
+			if (rc->rc_map[i].rm_pgdir == from
+			    && rc->rc_map[i].rm_va == va) {
+				rc->rc_map[i].rm_pgdir = to;
+				return;
+			}
+}
+
+//
+// Call 'fn' on every (page directory, va) that maps 'pp', until it
+// returns nonzero.  'fn' may remove the mapping it is called on, but
+// no other.  Returns the last value 'fn' returned, or 0.
+//
+int
+rmap_walk(struct PageInfo *pp,
+	  int (*fn)(pde_t *pgdir, uintptr_t va, void *arg), void *arg)
+{
+	struct RmapChunk *rc, *next;
+	pde_t *pgdir;
+	int i, r;
+
+	for (rc = PP_RMAP(pp); rc; rc = next) {
+		// fn may free rc along with its last pair.
+		next = rc->rc_next;
+		for (i = 0; i < RMAP_CHUNK_SIZE; i++) {
+			if (!(pgdir = rc->rc_map[i].rm_pgdir))
+				continue;
+			if ((r = fn(pgdir, rc->rc_map[i].rm_va, arg)))
+				return r;
+		}
+	}
+	return 0;
+}
+
+static int
+rmap_count_one(pde_t *pgdir, uintptr_t va, void *arg)
+{
+	++*(int *) arg;
+	return 0;
+}
+
+//
+// Return the number of mappings of 'pp'.
+//
+int
+rmap_count(struct PageInfo *pp)
+{
+	int n = 0;
+
+	rmap_walk(pp, rmap_count_one, &n);
+	return n;
+}
+
+//
+// Return the env whose page directory is 'pgdir', or NULL if it is the
+// kernel's.
+//
+struct Env *
+rmap_pgdir_env(pde_t *pgdir)
+{
+	if (pgdir == kern_pgdir)
+		return NULL;
+	return PP_ENV(pa2page(PADDR(pgdir)));
+}
+
+static int
+rmap_print_one(pde_t *pgdir, uintptr_t va, void *arg)
+{
+	struct Env *e = rmap_pgdir_env(pgdir);
+
+	if (e)
+		cprintf("  env %08x va %08x\n", e->env_id, va);
+	else
+		cprintf("  kernel  va %08x\n", va);
+	return 0;
+}
+
+//
+// Print the mappings of 'pp', for the kernel monitor.
+//
+void
+rmap_print(struct PageInfo *pp)
+{
+	if (pp == zero_page) {
+		cprintf("Page %08x is the zero page, mapped everywhere\n",
+			page2pa(pp));
+		return;
+	}
+	cprintf("Page %08x: %d references, %d mappings\n",
+		page2pa(pp), pp->pp_ref, rmap_count(pp));
+	rmap_walk(pp, rmap_print_one, NULL);
+}
@@ -0,0 +1,36 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_RMAP_H
+#define JOS_KERN_RMAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+// Mappings one chunk of a page's reverse map holds.
+#define RMAP_CHUNK_SIZE		3
+
+// A page's reverse map is a list of chunks of (page directory, va)
+// pairs, one pair per page table entry that maps the page.  Unused
+// pairs have a NULL rm_pgdir.
+struct RmapChunk {
+	struct RmapChunk *rc_next;
+	struct {
+		pde_t *rm_pgdir;
+		uintptr_t rm_va;
+	} rc_map[RMAP_CHUNK_SIZE];
+};
+
+void	rmap_init(void);
+int	rmap_add(struct PageInfo *pp, pde_t *pgdir, uintptr_t va);
+void	rmap_del(struct PageInfo *pp, pde_t *pgdir, uintptr_t va);
+void	rmap_move(struct PageInfo *pp, pde_t *from, pde_t *to, uintptr_t va);
+int	rmap_walk(struct PageInfo *pp,
+		  int (*fn)(pde_t *pgdir, uintptr_t va, void *arg), void *arg);
+int	rmap_count(struct PageInfo *pp);
+struct Env *rmap_pgdir_env(pde_t *pgdir);
+void	rmap_print(struct PageInfo *pp);
+
+#endif	// !JOS_KERN_RMAP_H
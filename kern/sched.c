@@ -3,58 +3,146 @@
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/ksm.h>
 #include <kern/monitor.h>
 
 void sched_halt(void);
 
+// Per-CPU run queues.
+//
+// Every ENV_RUNNABLE environment that is not loaded on some CPU sits
+// on exactly one run queue; running, blocked, dying and free envs sit
+// on none.  A CPU picks the head of its own queue, so choosing the next
+// env costs O(1) instead of a scan over all of envs[].  A CPU whose
+// queue is empty steals the head of the longest queue of another CPU.
+//
+// The queues are only touched with the big kernel lock held.
+struct RunQueue {
+	struct Env *rq_head;
+	struct Env *rq_tail;
+	int rq_len;
+};
+
+static struct RunQueue runqueues[NCPU];
+
+// True if 'e' is the current environment of some CPU.
+static bool
+env_on_cpu(struct Env *e)
+{
+	return e->env_cpunum >= 0 && e->env_cpunum < ncpu
+		&& cpus[e->env_cpunum].cpu_env == e;
+}
+
+// Pick the queue a newly runnable env should go on: the CPU it last
+// ran on, so it finds a warm cache, or the shortest queue if it has
+// never run.
+static int
+sched_home(struct Env *e)
+{
+	int i, best;
+
+	if (e->env_runs > 0 && e->env_cpunum >= 0 && e->env_cpunum < ncpu)
+		return e->env_cpunum;
+	best = cpunum();
+	for (i = 0; i < ncpu; i++)
+		if (runqueues[i].rq_len < runqueues[best].rq_len)
+			best = i;
+	return best;
+}
+
+static void
+runq_append(int cpu, struct Env *e)
+{
+	struct RunQueue *rq = &runqueues[cpu];
+
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail;
+	if (rq->rq_tail)
+		rq->rq_tail->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_tail = e;
+	rq->rq_len++;
+	e->env_rq_cpu = cpu;
+}
+
+// Put a runnable env on a run queue.  Does nothing if 'e' is already
+// queued, or if it is loaded on another CPU: that CPU puts it back on
+// its own queue when it switches away from it.
+void
+sched_enqueue(struct Env *e)
+{
+	assert(e->env_status == ENV_RUNNABLE);
+	if (e->env_rq_cpu >= 0)
+		return;
+	if (e != curenv && env_on_cpu(e))
+		return;
+	runq_append(e == curenv ? cpunum() : sched_home(e), e);
+}
+
+// Take 'e' off whatever run queue it is on, if any.
+void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq;
+
+	if (e->env_rq_cpu < 0)
+		return;
+	rq = &runqueues[e->env_rq_cpu];
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	rq->rq_len--;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+}
+
+// Steal work for this CPU: the env that has waited longest on the
+// longest queue of any other CPU.
+static struct Env *
+sched_steal(void)
+{
+	int i, victim = -1;
+
+	for (i = 0; i < ncpu; i++) {
+		if (i == cpunum() || !runqueues[i].rq_len)
+			continue;
+		if (victim < 0 || runqueues[i].rq_len > runqueues[victim].rq_len)
+			victim = i;
+	}
+	return victim < 0 ? NULL : runqueues[victim].rq_head;
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-
-	//default - no environments running yet
-	uint32_t i;
-	envid_t current_eid_index = 0;//environment index in 'envs[]' array
-	//Maybe we are the part of some running env
-	if(curenv){
-		current_eid_index = ENVX(curenv->env_id);
-	}
-	envid_t next_eid_index = (current_eid_index) % NENV;
-	envid_t next_eid_index_to_run = next_eid_index;
-	idle = NULL;
-	for(i=0;i<NENV;++i){
-		next_eid_index_to_run = (next_eid_index + i) % NENV;
-		if (envs[next_eid_index_to_run].env_status == ENV_RUNNABLE){
-			idle = &envs[next_eid_index_to_run];
-			break;
-		}
-	}
-	if(idle){//Successfully have found next env to run
-		env_run(idle);//does not return
-	}
-	// Looks like there are no runnable environments
-	// if current env (on my CPU) is running - let it run
-	else if (curenv && curenv->env_status == ENV_RUNNING){
-		env_run(curenv);
+	struct Env *e;
+
+	// The current env may have been made runnable without being
+	// queued (e.g. it set its own status); give it a place in line.
+	if (curenv && curenv->env_status == ENV_RUNNABLE)
+		sched_enqueue(curenv);
+
+	// Round-robin over this CPU's queue: env_run() puts the env we
+	// are leaving at the tail, so the head is the env that has
+	// waited longest.  If our queue is empty, steal.
+	if (!(e = runqueues[cpunum()].rq_head))
+		e = sched_steal();
+	if (e) {
+		sched_dequeue(e);
+		env_run(e);	// does not return
 	}
 
+	// Nothing else is runnable.  If the env previously running on
+	// this CPU is still ENV_RUNNING, it's okay to keep running it.
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
 
 	// sched_halt never returns
 	sched_halt();
@@ -70,19 +158,31 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING))
+	// Runnable envs are exactly the queued ones plus the ones some
+	// CPU is currently running, so this costs O(NCPU), not O(NENV).
+	for (i = 0; i < ncpu; i++) {
+		if (runqueues[i].rq_len)
+			break;
+		if (cpus[i].cpu_env
+		    && (cpus[i].cpu_env->env_status == ENV_RUNNABLE ||
+			cpus[i].cpu_env->env_status == ENV_RUNNING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == ncpu) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
+	// Put the idle time to use: zero some free pages, so that
+	// page_alloc(ALLOC_ZERO) does not have to, and look for user pages
+	// that can be merged.
+	page_zero_idle();
+	ksm_scan_idle();
+
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
+	thiscpu->cpu_pgdir = kern_pgdir;
 	lcr3(PADDR(kern_pgdir));
 
 	// Mark that this CPU is in the HALT state, so that when
@@ -94,13 +194,16 @@ sched_halt(void)
 	unlock_kernel();
 
 	// Reset stack pointer, enable interrupts and then halt.
+	// A TLB shootdown IPI returns here; halt again.
 	asm volatile (
 		"movl $0, %%ebp\n"
 		"movl %0, %%esp\n"
 		"pushl $0\n"
 		"pushl $0\n"
 		"sti\n"
+		"1:\n"
 		"hlt\n"
+		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
 }
 
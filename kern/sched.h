@@ -6,7 +6,14 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+// Per-CPU run queue maintenance; call whenever an env becomes
+// ENV_RUNNABLE (enqueue) or stops being runnable (dequeue).
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+
 #endif	// !JOS_KERN_SCHED_H
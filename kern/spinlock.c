@@ -7,6 +7,7 @@
 #include <inc/string.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/pmap.h>
 #include <kern/kdebug.h>
 
 // The big kernel lock
@@ -68,8 +69,13 @@ spin_lock(struct spinlock *lk)
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	// The holder of the big kernel lock may be waiting for us to
+	// carry out a TLB shootdown; keep serving those while we spin.
+	while (xchg(&lk->locked, 1) != 0) {
+		if (lk == &kernel_lock)
+			tlb_shootdown_handle();
 		asm volatile ("pause");
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
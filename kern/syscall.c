@@ -11,10 +11,16 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/kclock.h>
+#include <kern/vma.h>
+
+// Page operations sys_page_ops copies into the kernel at a time
+#define PAGEOP_CHUNK	16
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
-// Destroys the environment on memory errors.
+// Destroys the environment on memory errors; prints nothing if out of
+// memory to page the string in.
 static void
 sys_cputs(const char *s, size_t len)
 {
@@ -22,7 +28,8 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	user_mem_assert(curenv, s, len, 0);
+	if (user_mem_assert(curenv, s, len, 0) < 0)
+		return;
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
 }
@@ -90,13 +97,45 @@ sys_exofork(void)
 		cprintf("sys_exofork %e\n", r);
 		return r;
 	}
+	if ((r = env_copy_segments(e, thiscpu->cpu_env)) < 0) {
+		env_free(e);
+		return r;
+	}
 	e->env_tf = thiscpu->cpu_env->env_tf;
 	e->env_tf.tf_regs.reg_eax = 0;
+	sched_dequeue(e);
 	e->env_status = ENV_NOT_RUNNABLE;
 
 	return e->env_id;
 }
 
+// Create a runnable copy of the current environment, sharing its pages
+// copy-on-write (see env_copy_vm), with the same registers and page
+// fault upcall.  sys_fork returns 0 in the child.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *parent = thiscpu->cpu_env;
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, parent->env_id)) < 0)
+		return r;
+	if ((r = env_copy_segments(e, parent)) < 0
+	    || (r = env_copy_vm(e, parent)) < 0) {
+		env_free(e);
+		return r;
+	}
+	e->env_tf = parent->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = parent->env_pgfault_upcall;
+	return e->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -123,6 +162,10 @@ sys_env_set_status(envid_t envid, int status)
 		return -E_BAD_ENV;
 
 	e->env_status = status;
+	if (status == ENV_RUNNABLE)
+		sched_enqueue(e);
+	else
+		sched_dequeue(e);
 	return 0;
 }
 
@@ -178,7 +221,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 
 	// LAB 4: Your code here.
 	struct Env *e;
-	struct PageInfo *page;
+	struct Vma *v;
+	struct PageInfo *pp;
 	if ((uint32_t) va >= UTOP
 	    || (uint32_t) va % PGSIZE!=0)
 		return -E_INVAL;
@@ -191,13 +235,58 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (envid2env(envid, &e, 1) != 0)
 		return -E_BAD_ENV;
 
-	if ((page = page_alloc(ALLOC_ZERO)) == NULL)
+	// The new page reads as zeros: map the shared zero page until
+	// the env first writes it (see page_unshare).  In a region advised
+	// MADV_WILLNEED the env would write it soon anyway: allocate now.
+	if (vma_add(e, (uintptr_t) va, (uintptr_t) va + PGSIZE) < 0)
 		return -E_NO_MEM;
-
-	if (page_insert(e->env_pgdir, page, va, perm) != 0 ) {
-		page_free(page);
+	v = vma_lookup(e, (uintptr_t) va);
+	if (v && v->vm_advice == MADV_WILLNEED && (perm & PTE_W)) {
+		if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM)))
+			return -E_NO_MEM;
+		if (page_insert(e->env_pgdir, pp, va, perm) != 0) {
+			page_free(pp);
+			return -E_NO_MEM;
+		}
+		return 0;
+	}
+	if (page_insert(e->env_pgdir, zero_page, va, ZERO_PAGE_PERM(perm)) != 0)
 		return -E_NO_MEM;
+	return 0;
+}
+
+// Find the page 'e' maps at 'va', to map it again elsewhere with
+// 'perm', and store it in *pp_store.  A page of the program image not
+// touched yet is faulted in first, as a read would.  If 'perm' has
+// PTE_W and the page is copy-on-write, 'e' is given a private copy of
+// it, which is what gets mapped: both mappings then share one page.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if 'va' is not mapped, or (perm & PTE_W) and it is
+//		read-only and not copy-on-write.
+//	-E_NO_MEM if out of memory faulting in or copying the page.
+static int
+page_lookup_shared(struct Env *e, void *va, int perm,
+		   struct PageInfo **pp_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if (!page_lookup(e->env_pgdir, va, NULL)
+	    && (r = env_demand_page(e, (uintptr_t) va, 0)) < 0)
+		return r == -E_NO_MEM ? r : -E_INVAL;
+	if (!(pp = page_lookup(e->env_pgdir, va, &pte)))
+		return -E_INVAL;
+	if (!(perm & PTE_W) || (*pte & PTE_W)) {
+		*pp_store = pp;
+		return 0;
 	}
+	if (!(*pte & PTE_COW))
+		return -E_INVAL;
+	if ((r = page_unshare(e->env_pgdir, va)) <= 0)
+		return r < 0 ? r : -E_INVAL;
+	*pp_store = page_lookup(e->env_pgdir, va, NULL);
 	return 0;
 }
 
@@ -205,7 +294,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
-// page.
+// page.  A copy-on-write page may be mapped with PTE_W: srcenvid gets
+// its own copy of the page first, and that copy is shared (see
+// page_lookup_shared).
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
@@ -214,9 +305,10 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //		or dstva >= UTOP or dstva is not page-aligned.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
-//		address space.
-//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only and not
+//		copy-on-write in srcenvid's address space.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables,
+//		or to copy a copy-on-write srcva.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     envid_t dstenvid, void *dstva, int perm)
@@ -230,8 +322,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	// LAB 4: Your code here.
 	struct Env *se, *de;
-	pte_t *septe;
 	struct PageInfo *page;
+	int r;
 
 	if (envid2env(srcenvid, &se, 1)
 		|| envid2env(dstenvid, &de, 1))
@@ -252,18 +344,15 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	}
 
-	if (!(page = page_lookup(se->env_pgdir, srcva, &septe))) {
-		cprintf("sys_page_map: page not found\n");
-		return -E_INVAL;
+	// srcva may be a page of the program image not touched yet, or
+	// copy-on-write, which must be copied before it is shared writable
+	if ((r = page_lookup_shared(se, srcva, perm, &page)) < 0) {
+		cprintf("sys_page_map: source page: %e\n", r);
+		return r;
 	}
 
-	if ((perm & PTE_W) != 0
-		&& (*septe & PTE_W) == 0) {
-		cprintf("sys_page_map: invalid PTE_W\n");
-		return -E_INVAL;
-	}
-	
-	if (page_insert(de->env_pgdir, page, dstva, perm))
+	if (vma_add(de, (uintptr_t) dstva, (uintptr_t) dstva + PGSIZE) < 0
+	    || page_insert(de->env_pgdir, page, dstva, perm))
 		return -E_NO_MEM;
 
 	return 0;
@@ -276,6 +365,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if there's no memory to copy a page table shared by fork.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -289,10 +379,167 @@ sys_page_unmap(envid_t envid, void *va)
 	if (envid2env(envid, &e, 1))
 		return -E_BAD_ENV;
 
-	page_remove(e->env_pgdir, va);
+	if (page_remove(e->env_pgdir, va) < 0)
+		return -E_NO_MEM;
+	vma_remove(e, (uintptr_t) va, (uintptr_t) va + PGSIZE);
 	return 0;
 }
 
+// Tell the kernel how the env 'envid' means to use its memory in
+// [va, va + len), which is rounded out to whole pages:
+//	MADV_NORMAL	no particular way (undoes the others).
+//	MADV_SEQUENTIAL	in order: each page fault in the range faults in
+//			the next few pages as well.
+//	MADV_WILLNEED	soon: fault in the whole range now, giving every
+//			writable page a page of its own, and have
+//			sys_page_alloc in the range allocate at once.
+//	MADV_DONTNEED	no more: unmap every page in the range, as
+//			sys_page_unmap does, under one TLB shootdown.
+// Only the parts of the range the env has mapped are affected.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, the range reaches above UTOP,
+//		or advice is not one of the above.
+//	-E_NO_MEM if out of memory; the advice may then have been taken
+//		for part of the range.
+static int
+sys_madvise(envid_t envid, void *va, size_t len, int advice)
+{
+	struct Env *e;
+	struct Vma *v;
+	uintptr_t start = (uintptr_t) va, end = start + len, a;
+	int r;
+
+	if (start % PGSIZE != 0 || end < start || end > UTOP
+	    || advice < MADV_NORMAL || advice > MADV_DONTNEED)
+		return -E_INVAL;
+	if (envid2env(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	end = ROUNDUP(end, PGSIZE);
+
+	if (advice != MADV_DONTNEED) {
+		if ((r = vma_advise(e, start, end, advice)) < 0)
+			return r;
+		if (advice == MADV_WILLNEED)
+			return env_prefault(e, start, end, 1);
+		return 0;
+	}
+
+	// Page tables shared by fork are copied first: that may allocate.
+	for (a = start; a < end; a = ROUNDDOWN(a, PTSIZE) + PTSIZE)
+		if ((e->env_pgdir[PDX(a)] & PTE_P)
+		    && pgtable_unshare(e->env_pgdir, (void *) a) < 0)
+			return -E_NO_MEM;
+	tlb_batch_begin();
+	for (v = e->env_vmas; v && v->vm_start < end; v = v->vm_next)
+		for (a = MAX(start, v->vm_start); a < MIN(end, v->vm_end);
+		     a += PGSIZE) {
+			if (!(e->env_pgdir[PDX(a)] & PTE_P)) {
+				a = ROUNDDOWN(a, PTSIZE) + PTSIZE - PGSIZE;
+				continue;
+			}
+			page_remove(e->env_pgdir, (void *) a);
+		}
+	tlb_batch_end();
+	vma_remove(e, start, end);
+	return 0;
+}
+
+// Apply the page operations in 'ops', as sys_page_ops does, to a copy
+// in the kernel.  Returns the number that failed.
+static int
+page_ops_apply(struct PageOp *ops, int n)
+{
+	struct Env *e;
+	int i, j, nfailed = 0;
+
+	for (i = 0; i < n; i = j) {
+		if (ops[i].po_op != PAGEOP_UNMAP) {
+			if (ops[i].po_op == PAGEOP_ALLOC)
+				ops[i].po_result = sys_page_alloc(ops[i].po_env,
+					ops[i].po_va, ops[i].po_perm);
+			else if (ops[i].po_op == PAGEOP_MAP)
+				ops[i].po_result = sys_page_map(ops[i].po_env,
+					ops[i].po_va, ops[i].po_dstenv,
+					ops[i].po_dstva, ops[i].po_perm);
+			else
+				ops[i].po_result = -E_INVAL;
+			nfailed += ops[i].po_result < 0;
+			j = i + 1;
+			continue;
+		}
+
+		// A run of unmaps: take the pages away under one shootdown,
+		// then fix up the regions.  Whatever may allocate -- page
+		// tables shared by fork, the regions -- is done outside.
+		for (j = i; j < n && ops[j].po_op == PAGEOP_UNMAP; j++) {
+			ops[j].po_result = 0;
+			if ((uintptr_t) ops[j].po_va >= UTOP
+			    || (uintptr_t) ops[j].po_va % PGSIZE != 0)
+				ops[j].po_result = -E_INVAL;
+			else if (envid2env(ops[j].po_env, &e, 1) < 0)
+				ops[j].po_result = -E_BAD_ENV;
+			else if (pgtable_unshare(e->env_pgdir, ops[j].po_va) < 0)
+				ops[j].po_result = -E_NO_MEM;
+		}
+		tlb_batch_begin();
+		for (j = i; j < n && ops[j].po_op == PAGEOP_UNMAP; j++)
+			if (ops[j].po_result == 0) {
+				envid2env(ops[j].po_env, &e, 1);
+				page_remove(e->env_pgdir, ops[j].po_va);
+			}
+		tlb_batch_end();
+		for (; i < j; i++) {
+			if (ops[i].po_result < 0) {
+				nfailed++;
+				continue;
+			}
+			envid2env(ops[i].po_env, &e, 1);
+			vma_remove(e, (uintptr_t) ops[i].po_va,
+				   (uintptr_t) ops[i].po_va + PGSIZE);
+		}
+	}
+	return nfailed;
+}
+
+// Apply the 'n' page operations in 'ops' in order, as if by as many
+// calls to sys_page_alloc, sys_page_map and sys_page_unmap, but in one
+// kernel entry.  Each operation succeeds or fails on its own, and its
+// outcome is stored in its po_result.  The operations may remap the
+// pages that hold 'ops' itself: they are copied in and out a few at a
+// time.
+//
+// Returns the number of operations that failed, or < 0 on error.
+// Errors are:
+//	-E_INVAL if n < 0 or n > PAGEOP_MAX.
+//	-E_NO_MEM if there is no memory to page 'ops' in; operations in
+//		the chunks before may have been applied.
+// Destroys the environment if it cannot read or write 'ops'.
+static int
+sys_page_ops(struct PageOp *ops, int n)
+{
+	struct PageOp buf[PAGEOP_CHUNK];
+	int i, m, r, nfailed = 0;
+
+	if (n < 0 || n > PAGEOP_MAX)
+		return -E_INVAL;
+	for (i = 0; i < n; i += m) {
+		m = MIN(n - i, PAGEOP_CHUNK);
+		if ((r = user_mem_assert(curenv, ops + i,
+					 m * sizeof(struct PageOp), 0)) < 0)
+			return r;
+		memcpy(buf, ops + i, m * sizeof(struct PageOp));
+		nfailed += page_ops_apply(buf, m);
+		if ((r = user_mem_assert(curenv, ops + i,
+					 m * sizeof(struct PageOp), PTE_W)) < 0)
+			return r;
+		memcpy(ops + i, buf, m * sizeof(struct PageOp));
+	}
+	return nfailed;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -327,17 +574,17 @@ sys_page_unmap(envid_t envid, void *va)
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
 //		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
+//	-E_INVAL if (perm & PTE_W), but srcva is read-only and not
+//		copy-on-write in the current environment's address space.
+//		(A copy-on-write srcva is copied first, as in sys_page_map.)
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+//		address space, or to copy a copy-on-write srcva.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
   int r;
   struct Env * dstenv;
-  pte_t * pte;
   struct PageInfo *pp;
   // Check parameters
   // Check envid and env status
@@ -347,6 +594,9 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
   if (!dstenv->env_ipc_recving)
     return -E_IPC_NOT_RECV;
   
+  // No page is transferred unless both sides ask for one.
+  dstenv->env_ipc_perm = 0;
+
   // Check srcva and perm
   if ((uintptr_t)srcva < UTOP) {
     if (PGOFF(srcva) != 0)
@@ -358,18 +608,18 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     if (((perm | PTE_SYSCALL) != PTE_SYSCALL))
       return -E_INVAL;
 
-    // Check physical page exist
-    pp = page_lookup(curenv->env_pgdir, srcva, &pte);
-    if ((uintptr_t)srcva < UTOP && !pp)
-      return -E_INVAL;
-
-    // Check perm write conflict
-    if ((perm & PTE_W) && !(*pte & PTE_W))
-      return -E_INVAL;
+    // Check physical page exist and perm write conflict
+    r = page_lookup_shared(curenv, srcva, perm, &pp);
+    if (r < 0)
+      return r;
 
-    // Send mapping 
-    if (dstenv->env_ipc_dstva) {
+    // Send mapping, if the receiver wants one (dstva < UTOP)
+    if ((uintptr_t) dstenv->env_ipc_dstva < UTOP) {
       // Do page map
+      r = vma_add(dstenv, (uintptr_t) dstenv->env_ipc_dstva,
+                  (uintptr_t) dstenv->env_ipc_dstva + PGSIZE);
+      if (r < 0)
+        return -E_NO_MEM;
       r = page_insert(dstenv->env_pgdir, pp, dstenv->env_ipc_dstva, perm);
       if (r < 0)
         return -E_NO_MEM;
@@ -384,6 +634,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
   dstenv->env_ipc_value = value;
   dstenv->env_ipc_from = curenv->env_id;
   dstenv->env_status = ENV_RUNNABLE;
+  sched_enqueue(dstenv);
 
   return 0;
 }
@@ -417,6 +668,41 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// Copy to 'buf' up to 'n' of the regions of envid's address space
+// where pages may be mapped, starting with the first that ends after
+// 'from'.  Every mapped page below UTOP lies in one of the regions, so
+// callers can skip the rest of the address space.
+//
+// Returns the number of regions copied, 0 once there are no more,
+// < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if n is negative.
+//	-E_NO_MEM if there is no memory to page 'buf' in.
+static int
+sys_vma_list(envid_t envid, uintptr_t from, struct VmaInfo *buf, int n)
+{
+	struct Env *e;
+	int r;
+
+	if (envid2env(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+	if (n < 0)
+		return -E_INVAL;
+	n = MIN(n, e->env_nvmas);
+	if ((r = user_mem_assert(curenv, buf, n * sizeof(struct VmaInfo),
+				 PTE_W)) < 0)
+		return r;
+	return vma_list(e, from, buf, n);
+}
+
+// Return the current time in milliseconds since boot.
+static int
+sys_time_msec(void)
+{
+	return time_msec();
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -480,6 +766,28 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
   case SYS_ipc_recv : 
     ret = (uint32_t)sys_ipc_recv((void *)a1);
     break;
+
+  case SYS_time_msec :
+    ret = (uint32_t)sys_time_msec();
+    break;
+
+  case SYS_vma_list :
+    ret = (uint32_t)sys_vma_list((envid_t)a1, (uintptr_t)a2,
+                                 (struct VmaInfo *)a3, (int)a4);
+    break;
+
+  case SYS_fork :
+    ret = (uint32_t)sys_fork();
+    break;
+
+  case SYS_page_ops :
+    ret = (uint32_t)sys_page_ops((struct PageOp *)a1, (int)a2);
+    break;
+
+  case SYS_madvise :
+    ret = (uint32_t)sys_madvise((envid_t)a1, (void *)a2, (size_t)a3,
+                                (int)a4);
+    break;
   
   default :
     ret = -E_INVAL;
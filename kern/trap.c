@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -82,7 +83,7 @@ trap_init(void)
 
 //	extern long trap_handlers[MAX_IDT_NUM];
 	// Challenge 1
-	extern long trap_handlers[48];
+	extern long trap_handlers[T_TLBFLUSH + 1];
 	extern long interrupt_vector48;
 
 
@@ -108,6 +109,8 @@ trap_init(void)
 //	SETGATE(idt[T_SYSCALL], 0, GD_KT, trap_handlers[T_SYSCALL], USR_CPL);
 	//After chalenge 1
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, &interrupt_vector48, USR_CPL);
+	// TLB shootdown IPIs from other CPUs (see tlb_invalidate)
+	SETGATE(idt[T_TLBFLUSH], 0, GD_KT, trap_handlers[T_TLBFLUSH], KERNEL_CPL);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -292,6 +295,14 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Serve TLB shootdowns right away, without the big kernel lock:
+	// the CPU that sent the IPI holds it and is waiting for us.
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		tlb_shootdown_handle();
+		lapic_eoi();
+		env_pop_tf(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -345,6 +356,7 @@ void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -360,6 +372,34 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// The first touch of a page of the program image fills it in,
+	// and the first write to the shared zero page copies it.  In a
+	// region advised MADV_SEQUENTIAL the pages after it are done too.
+	// Only a fault outside the program image goes on to the env.
+	if (!(tf->tf_err & FEC_PR)
+	    && (r = env_demand_page(curenv, fault_va,
+				    tf->tf_err & FEC_WR)) != -E_FAULT) {
+		if (r == 0) {
+			env_fault_around(curenv, fault_va, tf->tf_err & FEC_WR);
+			return;
+		}
+		cprintf("[%08x] out of memory paging in va %08x\n",
+			curenv->env_id, fault_va);
+		env_destroy(curenv);
+		return;
+	}
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)
+	    && (r = page_unshare(curenv->env_pgdir, (void *) fault_va))) {
+		if (r > 0) {
+			env_fault_around(curenv, fault_va, 1);
+			return;
+		}
+		cprintf("[%08x] out of memory copying a copy-on-write page at va %08x\n",
+			curenv->env_id, fault_va);
+		env_destroy(curenv);
+		return;
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -411,8 +451,13 @@ page_fault_handler(struct Trapframe *tf)
 			utf = (struct UTrapframe *)(UXSTACKTOP - sizeof(struct UTrapframe));
 		}
 		// Ensure you're in user memory
-		user_mem_assert(curenv, utf, sizeof(struct UTrapframe),
-				PTE_U | PTE_W | PTE_P);
+		if (user_mem_assert(curenv, utf, sizeof(struct UTrapframe),
+				    PTE_U | PTE_W | PTE_P) < 0) {
+			cprintf("[%08x] out of memory for the exception stack\n",
+				curenv->env_id);
+			env_destroy(curenv);
+			return;
+		}
 		utf->utf_esp = tf->tf_esp;
 		utf->utf_eflags = tf->tf_eflags;
 		utf->utf_eip = tf->tf_eip;
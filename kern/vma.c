@@ -0,0 +1,350 @@
+// Per-env regions of mapped address space.
+//
+// Every env keeps a sorted list of the regions below UTOP where it may
+// have pages mapped: the segments of its program image, its stack, and
+// every page it got through sys_page_alloc, sys_page_map or IPC.
+// Neighbouring regions are merged, so an env usually has a handful.
+// A page is removed from its region when it is unmapped through
+// sys_page_unmap.
+//
+// The list may claim more than is mapped (a page of the program image
+// that was never touched, or a region that could not be split for
+// lack of memory), but never less: whatever is mapped lies in some
+// region.  That lets fork, env_free and the monitor visit only the
+// regions instead of the whole address space.
+//
+// A region also carries the advice sys_madvise was given for it.  A
+// region that grows takes in whatever it reaches with its own advice,
+// except for the part of a neighbour with other advice that it does
+// not cover.
+
+#include <inc/types.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/vma.h>
+
+static struct KmemCache *vma_cache;
+
+static struct Vma *
+vma_alloc(uintptr_t start, uintptr_t end, struct Vma *next)
+{
+	struct Vma *v;
+
+	if (!vma_cache)
+		vma_cache = kmem_cache_create("vma", sizeof(struct Vma), 0, NULL);
+	if (!vma_cache || !(v = kmem_cache_alloc(vma_cache)))
+		return NULL;
+	v->vm_start = start;
+	v->vm_end = end;
+	v->vm_advice = MADV_NORMAL;
+	v->vm_next = next;
+	return v;
+}
+
+static void
+vma_free(struct Env *e, struct Vma *v)
+{
+	kmem_cache_free(vma_cache, v);
+	e->env_nvmas--;
+}
+
+//
+// Record that 'e' may map pages in [start, end), rounded out to whole
+// pages.  Returns 0 on success, -E_NO_MEM if out of memory.
+//
+int
+vma_add(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	struct Vma **prev, *v, *n;
+
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	assert(start < end && end <= UTOP);
+
+	for (prev = &e->env_vmas; (v = *prev) && v->vm_end < start;
+	     prev = &v->vm_next)
+		;
+	if (!v || end < v->vm_start) {
+		if (!(*prev = vma_alloc(start, end, v))) {
+			*prev = v;
+			return -E_NO_MEM;
+		}
+		e->env_nvmas++;
+		return 0;
+	}
+
+	// 'v' overlaps or touches [start, end): grow it, and swallow the
+	// regions it now reaches.
+	v->vm_start = MIN(v->vm_start, start);
+	v->vm_end = MAX(v->vm_end, end);
+	while ((n = v->vm_next) && n->vm_start <= v->vm_end) {
+		if (n->vm_advice != v->vm_advice && n->vm_end > v->vm_end) {
+			n->vm_start = v->vm_end;
+			break;
+		}
+		v->vm_end = MAX(v->vm_end, n->vm_end);
+		v->vm_next = n->vm_next;
+		vma_free(e, n);
+	}
+	return 0;
+}
+
+//
+// Record that 'e' no longer maps anything in [start, end).  If a region
+// would have to be split and there is no memory for that, it is left
+// whole.
+//
+void
+vma_remove(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	struct Vma **prev, *v, *n;
+
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	for (prev = &e->env_vmas; (v = *prev) && v->vm_start < end; ) {
+		if (v->vm_end <= start) {
+			prev = &v->vm_next;
+		} else if (start <= v->vm_start && v->vm_end <= end) {
+			*prev = v->vm_next;
+			vma_free(e, v);
+		} else if (v->vm_start < start && end < v->vm_end) {
+			if ((n = vma_alloc(end, v->vm_end, v->vm_next))) {
+				n->vm_advice = v->vm_advice;
+				v->vm_end = start;
+				v->vm_next = n;
+				e->env_nvmas++;
+			}
+			return;
+		} else {
+			if (v->vm_start < start)
+				v->vm_end = start;
+			else
+				v->vm_start = end;
+			prev = &v->vm_next;
+		}
+	}
+}
+
+// Split 'v' at 'va', which lies inside it.  Returns the upper part, or
+// NULL if out of memory.
+static struct Vma *
+vma_split(struct Env *e, struct Vma *v, uintptr_t va)
+{
+	struct Vma *n;
+
+	if (!(n = vma_alloc(va, v->vm_end, v->vm_next)))
+		return NULL;
+	n->vm_advice = v->vm_advice;
+	v->vm_end = va;
+	v->vm_next = n;
+	e->env_nvmas++;
+	return n;
+}
+
+//
+// Give the parts of 'e's regions that lie in [start, end), rounded out
+// to whole pages, the advice 'advice'.  Returns 0 on success, -E_NO_MEM
+// if a region could not be split for lack of memory; the advice may
+// then have been taken for part of the range.
+//
+int
+vma_advise(struct Env *e, uintptr_t start, uintptr_t end, int advice)
+{
+	struct Vma *v, *n;
+
+	start = ROUNDDOWN(start, PGSIZE);
+	end = ROUNDUP(end, PGSIZE);
+	for (v = e->env_vmas; v && v->vm_start < end; v = v->vm_next) {
+		if (v->vm_end <= start || v->vm_advice == advice)
+			continue;
+		if (v->vm_start < start && !(v = vma_split(e, v, start)))
+			return -E_NO_MEM;
+		if (end < v->vm_end && !vma_split(e, v, end))
+			return -E_NO_MEM;
+		v->vm_advice = advice;
+	}
+
+	// Neighbours that touch and now have the same advice are one.
+	for (v = e->env_vmas; v && (n = v->vm_next); ) {
+		if (n->vm_start == v->vm_end && n->vm_advice == v->vm_advice) {
+			v->vm_end = n->vm_end;
+			v->vm_next = n->vm_next;
+			vma_free(e, n);
+		} else
+			v = n;
+	}
+	return 0;
+}
+
+//
+// Return the region of 'e' that holds 'va', or NULL if there is none.
+//
+struct Vma *
+vma_lookup(struct Env *e, uintptr_t va)
+{
+	struct Vma *v;
+
+	for (v = e->env_vmas; v && v->vm_start <= va; v = v->vm_next)
+		if (va < v->vm_end)
+			return v;
+	return NULL;
+}
+
+//
+// Forget all regions of 'e', for env_free.
+//
+void
+vma_free_all(struct Env *e)
+{
+	struct Vma *v;
+
+	while ((v = e->env_vmas)) {
+		e->env_vmas = v->vm_next;
+		vma_free(e, v);
+	}
+	assert(e->env_nvmas == 0);
+}
+
+//
+// Copy to 'buf' up to 'n' regions of 'e' that end after 'from'.
+// Returns the number copied; 0 once there are no more.
+//
+int
+vma_list(struct Env *e, uintptr_t from, struct VmaInfo *buf, int n)
+{
+	struct Vma *v;
+	int i = 0;
+
+	for (v = e->env_vmas; v && i < n; v = v->vm_next) {
+		if (v->vm_end <= from)
+			continue;
+		buf[i].vi_start = v->vm_start;
+		buf[i].vi_end = v->vm_end;
+		buf[i].vi_advice = v->vm_advice;
+		i++;
+	}
+	return i;
+}
+
+void
+vma_print(struct Env *e)
+{
+	static const char *advice[] = { "", " sequential", " willneed" };
+	struct Vma *v;
+	size_t pages = 0;
+
+	for (v = e->env_vmas; v; v = v->vm_next) {
+		cprintf("  %08x-%08x %6uKB%s\n", v->vm_start, v->vm_end,
+			(v->vm_end - v->vm_start) / 1024, advice[v->vm_advice]);
+		pages += (v->vm_end - v->vm_start) / PGSIZE;
+	}
+	cprintf("Env %08x: %d regions, %u pages\n",
+		e->env_id, e->env_nvmas, pages);
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+// Check that 'e' has exactly the 'n' regions in 'want', in order.
+static void
+check_vma_list(struct Env *e, const struct VmaInfo *want, int n)
+{
+	struct Vma *v;
+	int i = 0;
+
+	for (v = e->env_vmas; v; v = v->vm_next, i++) {
+		assert(i < n);
+		assert(v->vm_start == want[i].vi_start
+		       && v->vm_end == want[i].vi_end
+		       && v->vm_advice == want[i].vi_advice);
+	}
+	assert(i == n && e->env_nvmas == n);
+}
+
+void
+check_vma(void)
+{
+	static struct Env env;
+	struct Env *e = &env;
+	const uintptr_t b = UTEXT, p = PGSIZE;
+
+	// an add that touches a region grows it
+	assert(vma_add(e, b, b + 2*p) == 0);
+	assert(vma_add(e, b + 2*p, b + 3*p) == 0);
+	assert(vma_add(e, b + 5*p, b + 6*p) == 0);
+	{
+		const struct VmaInfo want[] = {
+			{ b, b + 3*p, MADV_NORMAL },
+			{ b + 5*p, b + 6*p, MADV_NORMAL },
+		};
+		check_vma_list(e, want, 2);
+	}
+
+	// one that overlaps two swallows the one it reaches
+	assert(vma_add(e, b + p, b + 5*p) == 0);
+	{
+		const struct VmaInfo want[] = {
+			{ b, b + 6*p, MADV_NORMAL },
+		};
+		check_vma_list(e, want, 1);
+	}
+
+	// advice splits a region in three
+	assert(vma_advise(e, b + 2*p, b + 4*p, MADV_SEQUENTIAL) == 0);
+	{
+		const struct VmaInfo want[] = {
+			{ b, b + 2*p, MADV_NORMAL },
+			{ b + 2*p, b + 4*p, MADV_SEQUENTIAL },
+			{ b + 4*p, b + 6*p, MADV_NORMAL },
+		};
+		check_vma_list(e, want, 3);
+	}
+
+	// a region that grows into a neighbour with other advice takes
+	// only what it covers
+	assert(vma_add(e, b + 3*p, b + 5*p) == 0);
+	{
+		const struct VmaInfo want[] = {
+			{ b, b + 2*p, MADV_NORMAL },
+			{ b + 2*p, b + 5*p, MADV_SEQUENTIAL },
+			{ b + 5*p, b + 6*p, MADV_NORMAL },
+		};
+		check_vma_list(e, want, 3);
+	}
+	assert(vma_lookup(e, b + 4*p)->vm_advice == MADV_SEQUENTIAL);
+	assert(!vma_lookup(e, b + 6*p));
+
+	// the same advice again makes them one
+	assert(vma_advise(e, b, b + 6*p, MADV_NORMAL) == 0);
+	{
+		const struct VmaInfo want[] = {
+			{ b, b + 6*p, MADV_NORMAL },
+		};
+		check_vma_list(e, want, 1);
+	}
+
+	// removing the middle splits it; the ends are trimmed
+	vma_remove(e, b + 2*p, b + 3*p);
+	vma_remove(e, b, b + p);
+	vma_remove(e, b + 5*p, b + 8*p);
+	{
+		const struct VmaInfo want[] = {
+			{ b + p, b + 2*p, MADV_NORMAL },
+			{ b + 3*p, b + 5*p, MADV_NORMAL },
+		};
+		check_vma_list(e, want, 2);
+	}
+	assert(!vma_lookup(e, b + 2*p));
+	assert(vma_lookup(e, b + 3*p)->vm_start == b + 3*p);
+
+	vma_free_all(e);
+	assert(!e->env_vmas);
+	cprintf("check_vma() succeeded!\n");
+}
@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_VMA_H
+#define JOS_KERN_VMA_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// A region of an env's address space below UTOP, page aligned.  An
+// env's regions are kept sorted and never overlap; two touch only if
+// their advice differs.
+struct Vma {
+	uintptr_t vm_start;
+	uintptr_t vm_end;
+	int vm_advice;		// MADV_NORMAL, _SEQUENTIAL or _WILLNEED
+	struct Vma *vm_next;
+};
+
+int	vma_add(struct Env *e, uintptr_t start, uintptr_t end);
+void	vma_remove(struct Env *e, uintptr_t start, uintptr_t end);
+int	vma_advise(struct Env *e, uintptr_t start, uintptr_t end, int advice);
+struct Vma *vma_lookup(struct Env *e, uintptr_t va);
+void	vma_free_all(struct Env *e);
+int	vma_list(struct Env *e, uintptr_t from, struct VmaInfo *buf, int n);
+void	vma_print(struct Env *e);
+void	check_vma(void);
+
+#endif	// !JOS_KERN_VMA_H
@@ -0,0 +1,425 @@
+// Kernel virtual address ranges.
+//
+// Two arenas of kernel address space are handed out a range at a time:
+// [VMALLOCBASE, KMAPBASE) for vmap and vmalloc, which map any pages,
+// however scattered, at contiguous addresses, and [MMIOBASE, MMIOLIM)
+// for ioremap, which maps device memory.  Each arena keeps a bit per
+// page, set while the page is part of a range.  Every range is followed
+// by an unused guard page, so an overrun faults instead of running into
+// the next range, and so the end of a range can be found from its
+// start: freeing needs no record of the size.
+//
+// The page tables of both arenas are made once (vm_init), before any
+// env copies the kernel's page directory entries, so a mapping made
+// later shows up in every address space.  Unmapping shoots down the
+// TLBs of all CPUs.
+//
+// Like everything else here, this relies on the big kernel lock.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+#include <kern/pmap.h>
+#include <kern/vmalloc.h>
+
+#define VMALLOC_NPAGES	((KMAPBASE - VMALLOCBASE) / PGSIZE)
+#define MMIO_NPAGES	((MMIOLIM - MMIOBASE) / PGSIZE)
+
+struct VmArena {
+	const char *va_name;
+	uintptr_t va_base;
+	size_t va_npages;
+	uint32_t *va_used;		// A bit per page: in some range
+};
+
+static uint32_t vmalloc_used[VMALLOC_NPAGES / 32];
+static uint32_t mmio_used[MMIO_NPAGES / 32];
+
+static struct VmArena vm_vmalloc = {
+	"vmalloc", VMALLOCBASE, VMALLOC_NPAGES, vmalloc_used
+};
+static struct VmArena vm_mmio = {
+	"ioremap", MMIOBASE, MMIO_NPAGES, mmio_used
+};
+
+static bool
+vm_used(struct VmArena *a, size_t i)
+{
+	return (a->va_used[i / 32] >> (i % 32)) & 1;
+}
+
+static void
+vm_set(struct VmArena *a, size_t i, bool used)
+{
+	if (used)
+		a->va_used[i / 32] |= 1U << (i % 32);
+	else
+		a->va_used[i / 32] &= ~(1U << (i % 32));
+}
+
+// Reserve a range of 'n' pages in 'a', first fit, with an unused page
+// after it and (unless it starts the arena) one before it.  Returns the
+// index of its first page, or -1 if there is no room.
+static int
+vm_reserve(struct VmArena *a, size_t n)
+{
+	size_t start = 0, i;
+
+	if (!n)
+		return -1;
+	while (start + n < a->va_npages) {
+		for (i = start; i <= start + n && !vm_used(a, i); i++)
+			;
+		if (i > start + n) {
+			for (i = start; i < start + n; i++)
+				vm_set(a, i, 1);
+			return start;
+		}
+		// Skip the range in the way, and the page after it.
+		while (i < a->va_npages && vm_used(a, i))
+			i++;
+		start = i + 1;
+	}
+	return -1;
+}
+
+// The number of pages in the range of 'a' that starts at 'va', or 0 if
+// no range starts there.
+static size_t
+vm_range_pages(struct VmArena *a, uintptr_t va)
+{
+	size_t start, i;
+
+	if (va < a->va_base || va % PGSIZE)
+		return 0;
+	start = (va - a->va_base) / PGSIZE;
+	if (start >= a->va_npages || !vm_used(a, start)
+	    || (start && vm_used(a, start - 1)))
+		return 0;
+	for (i = start; i < a->va_npages && vm_used(a, i); i++)
+		;
+	return i - start;
+}
+
+// The page table entry bits that select memory type 'cache'.
+// mem_init_percpu sets up the PAT so that PTE_PCD alone means
+// write-combining; without a PAT it means uncached, which is the
+// safe substitute.
+static int
+vm_cache_bits(int cache)
+{
+	switch (cache) {
+	case VM_CACHE_WT:
+		return PTE_PWT;
+	case VM_CACHE_WC:
+		return PTE_PCD;
+	case VM_CACHE_UC:
+		return PTE_PCD | PTE_PWT;
+	default:
+		return 0;
+	}
+}
+
+// Map physical page 'pa' at kernel address 'va'.
+static int
+vm_map_page(uintptr_t va, physaddr_t pa, int cache)
+{
+	pte_t *pte;
+
+	if (!(pte = pgdir_walk(kern_pgdir, (void *) va, 1)))
+		return -1;
+	// Nothing was mapped here, so no TLB can hold the address.
+	*pte = pa | vm_cache_bits(cache) | PTE_P | PTE_W | PTE_G;
+	return 0;
+}
+
+// Unmap the range of 'a' at 'va', which is 'n' pages long, and give
+// it back.  If 'put', drop a reference to each page that was mapped
+// there, once no TLB holds it any more.
+static void
+vm_unmap(struct VmArena *a, uintptr_t va, size_t n, bool put)
+{
+	struct PageInfo *pp, *freed = NULL;
+	size_t i, start = (va - a->va_base) / PGSIZE;
+	pte_t *pte;
+
+	tlb_batch_begin();
+	for (i = 0; i < n; i++) {
+		pte = pgdir_walk(kern_pgdir, (void *) (va + i * PGSIZE), 0);
+		if (!pte || !(*pte & PTE_P))
+			continue;
+		pp = put ? pa2page(PTE_ADDR(*pte)) : NULL;
+		*pte = 0;
+		tlb_invalidate(kern_pgdir, (void *) (va + i * PGSIZE));
+		if (pp && --pp->pp_ref == 0) {
+			PP_LINK(pp) = freed;
+			freed = pp;
+		}
+	}
+	tlb_batch_end();
+
+	for (i = start; i < start + n; i++)
+		vm_set(a, i, 0);
+	while ((pp = freed)) {
+		freed = PP_LINK(pp);
+		PP_LINK(pp) = NULL;
+		page_free(pp);
+	}
+}
+
+//
+// Make the page tables of the vmalloc and ioremap arenas.  Called by
+// mem_init, before kern_pgdir is loaded.
+//
+void
+vm_init(void)
+{
+	uintptr_t va;
+
+	for (va = VMALLOCBASE; va < KMAPBASE; va += PTSIZE)
+		if (!pgdir_walk(kern_pgdir, (void *) va, 1))
+			panic("vm_init: out of memory");
+	if (!pgdir_walk(kern_pgdir, (void *) MMIOBASE, 1))
+		panic("vm_init: out of memory");
+}
+
+//
+// Map the 'n' pages in 'pps' at contiguous kernel addresses, with
+// memory type 'cache', and return the first address.  Each page gains
+// a reference, which vunmap drops.  Returns NULL if there is no room.
+//
+// Do not map a page of low memory with any type but VM_CACHE_WB: the
+// direct map has it write-back already, and the CPU does not promise
+// what happens to a page mapped with two types.
+//
+void *
+vmap(struct PageInfo **pps, size_t n, int cache)
+{
+	uintptr_t va;
+	size_t i;
+	int start;
+
+	if ((start = vm_reserve(&vm_vmalloc, n)) < 0)
+		return NULL;
+	va = vm_vmalloc.va_base + start * PGSIZE;
+	for (i = 0; i < n; i++) {
+		// The page tables are all there: this cannot fail.
+		vm_map_page(va + i * PGSIZE, page2pa(pps[i]), cache);
+		pps[i]->pp_ref++;
+	}
+	return (void *) va;
+}
+
+//
+// Unmap what vmap or vmalloc mapped at 'va'.
+//
+void
+vunmap(void *va)
+{
+	size_t n;
+
+	if (!(n = vm_range_pages(&vm_vmalloc, (uintptr_t) va)))
+		panic("vunmap: nothing mapped at %08x", (uintptr_t) va);
+	vm_unmap(&vm_vmalloc, (uintptr_t) va, n, 1);
+}
+
+//
+// Allocate 'size' bytes of virtually contiguous kernel memory, of
+// memory type 'cache', made of pages that need not be contiguous.  The
+// memory is not zeroed.  Returns NULL if out of memory or address space.
+//
+// The pages come from high memory where there is some: they need no
+// address in the direct map, and there they have no second mapping of
+// another memory type.
+//
+void *
+vmalloc(size_t size, int cache)
+{
+	struct PageInfo *pp;
+	uintptr_t va;
+	size_t i, n = ROUNDUP(size, PGSIZE) / PGSIZE;
+	int start;
+
+	if ((start = vm_reserve(&vm_vmalloc, n)) < 0)
+		return NULL;
+	va = vm_vmalloc.va_base + start * PGSIZE;
+	for (i = 0; i < n; i++) {
+		if (!(pp = page_alloc(ALLOC_HIGHMEM))) {
+			vm_unmap(&vm_vmalloc, va, n, 1);
+			return NULL;
+		}
+		vm_map_page(va + i * PGSIZE, page2pa(pp), cache);
+		pp->pp_ref++;
+	}
+	return (void *) va;
+}
+
+//
+// Free what vmalloc returned.  The same as vunmap: the pages go with
+// their last reference.
+//
+void
+vfree(void *va)
+{
+	vunmap(va);
+}
+
+//
+// Map the device memory [pa, pa+size) into the kernel, with memory type
+// 'cache', and return the address of 'pa'.  Neither need be aligned.
+// Returns NULL if there is no room.
+//
+void *
+ioremap(physaddr_t pa, size_t size, int cache)
+{
+	uintptr_t va;
+	size_t i, n = ROUNDUP(PGOFF(pa) + size, PGSIZE) / PGSIZE;
+	int start;
+
+	if ((start = vm_reserve(&vm_mmio, n)) < 0)
+		return NULL;
+	va = vm_mmio.va_base + start * PGSIZE;
+	for (i = 0; i < n; i++)
+		if (vm_map_page(va + i * PGSIZE,
+				ROUNDDOWN(pa, PGSIZE) + i * PGSIZE, cache) < 0) {
+			vm_unmap(&vm_mmio, va, n, 0);
+			return NULL;
+		}
+	return (void *) (va + PGOFF(pa));
+}
+
+//
+// Unmap what ioremap mapped at 'va'.
+//
+void
+iounmap(void *va)
+{
+	uintptr_t base = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	size_t n;
+
+	if (!(n = vm_range_pages(&vm_mmio, base)))
+		panic("iounmap: nothing mapped at %08x", (uintptr_t) va);
+	vm_unmap(&vm_mmio, base, n, 0);
+}
+
+static void
+vm_print_arena(struct VmArena *a)
+{
+	static const char *types[] = { "WB", "WT", "WC", "UC" };
+	size_t i, n, used = 0, nranges = 0;
+	uintptr_t va;
+	pte_t *pte;
+
+	for (i = 0; i < a->va_npages; i += n + 1) {
+		va = a->va_base + i * PGSIZE;
+		if (!(n = vm_range_pages(a, va))) {
+			n = 0;
+			continue;
+		}
+		pte = pgdir_walk(kern_pgdir, (void *) va, 0);
+		cprintf("  %08x-%08x %6uKB %s\n", va, va + n * PGSIZE,
+			n * PGSIZE / 1024,
+			pte && (*pte & PTE_P)
+			? types[(*pte & PTE_PWT ? 1 : 0) | (*pte & PTE_PCD ? 2 : 0)]
+			: "--");
+		used += n;
+		nranges++;
+	}
+	cprintf("%s: %u ranges, %u of %u pages\n",
+		a->va_name, nranges, used, a->va_npages);
+}
+
+//
+// Print the ranges in use, for the kernel monitor.
+//
+void
+vm_print(void)
+{
+	vm_print_arena(&vm_vmalloc);
+	vm_print_arena(&vm_mmio);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static bool
+check_mapped(uintptr_t va)
+{
+	pte_t *pte = pgdir_walk(kern_pgdir, (void *) va, 0);
+
+	return pte && (*pte & PTE_P);
+}
+
+//
+// Check vmap, vmalloc and ioremap.  Called by mem_init once kern_pgdir
+// is loaded.
+//
+void
+check_vmalloc(void)
+{
+	struct PageInfo *pp[2];
+	uint8_t *p, *q, *r;
+	pte_t *pte;
+	int i;
+
+	// a buffer of several pages, contiguous and followed by a guard
+	assert((p = vmalloc(3 * PGSIZE + 1, VM_CACHE_WB)));
+	assert((uintptr_t) p >= VMALLOCBASE && (uintptr_t) p < KMAPBASE);
+	assert((uintptr_t) p % PGSIZE == 0);
+	for (i = 0; i < 4 * PGSIZE; i++)
+		p[i] = i % 251;
+	for (i = 0; i < 4 * PGSIZE; i++)
+		assert(p[i] == i % 251);
+	assert(!check_mapped((uintptr_t) p + 4 * PGSIZE));
+
+	// the next one is past the guard page, with the type asked for
+	assert((q = vmalloc(PGSIZE, VM_CACHE_WC)));
+	assert(q >= p + 5 * PGSIZE);
+	pte = pgdir_walk(kern_pgdir, q, 0);
+	assert((*pte & (PTE_PCD | PTE_PWT)) == PTE_PCD);
+	q[0] = 1;
+
+	// freed address space is used again
+	vfree(p);
+	for (i = 0; i < 4; i++)
+		assert(!check_mapped((uintptr_t) p + i * PGSIZE));
+	assert((r = vmalloc(2 * PGSIZE, VM_CACHE_WB)) == p);
+	vfree(r);
+	vfree(q);
+
+	// vmap maps the pages it is given, in that order, and holds them
+	assert((pp[1] = page_alloc(ALLOC_ZERO)));
+	assert((pp[0] = page_alloc(ALLOC_ZERO)));
+	pp[0]->pp_ref++;
+	pp[1]->pp_ref++;
+	assert((p = vmap(pp, 2, VM_CACHE_WB)));
+	p[0] = 0x11;
+	p[PGSIZE] = 0x22;
+	assert(*(uint8_t *) page2kva(pp[0]) == 0x11);
+	assert(*(uint8_t *) page2kva(pp[1]) == 0x22);
+	assert(pp[0]->pp_ref == 2 && pp[1]->pp_ref == 2);
+	vunmap(p);
+	assert(pp[0]->pp_ref == 1 && pp[1]->pp_ref == 1);
+	page_decref(pp[0]);
+	page_decref(pp[1]);
+
+	// ioremap keeps the offset into the page and maps uncached
+	assert((p = ioremap(0x1234, 2 * PGSIZE, VM_CACHE_UC)));
+	assert((uintptr_t) p >= MMIOBASE && (uintptr_t) p < MMIOLIM);
+	assert(PGOFF(p) == 0x234);
+	pte = pgdir_walk(kern_pgdir, p, 0);
+	assert(PTE_ADDR(*pte) == 0x1000);
+	assert((*pte & (PTE_PCD | PTE_PWT)) == (PTE_PCD | PTE_PWT));
+	assert(check_mapped((uintptr_t) p + 2 * PGSIZE));
+	assert(!check_mapped((uintptr_t) p + 3 * PGSIZE));
+	iounmap(p);
+	assert(!check_mapped((uintptr_t) p));
+
+	cprintf("check_vmalloc() succeeded!\n");
+}
@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_VMALLOC_H
+#define JOS_KERN_VMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct PageInfo;
+
+// Memory types for vmap, vmalloc and ioremap (see vm_cache_bits).
+enum {
+	VM_CACHE_WB = 0,	// Write-back: ordinary memory
+	VM_CACHE_WT,		// Write-through: reads cached, writes not
+	VM_CACHE_WC,		// Write-combining: buffers written in bulk
+	VM_CACHE_UC,		// Uncached: device registers
+};
+
+void	vm_init(void);
+void *	vmap(struct PageInfo **pps, size_t n, int cache);
+void	vunmap(void *va);
+void *	vmalloc(size_t size, int cache);
+void	vfree(void *va);
+void *	ioremap(physaddr_t pa, size_t size, int cache);
+void	iounmap(void *va);
+void	vm_print(void);
+void	check_vmalloc(void);
+
+#endif	// !JOS_KERN_VMALLOC_H
@@ -0,0 +1,552 @@
+// Compressed in-memory swap.
+//
+// When page_alloc runs out of free memory it asks zram_reclaim to make
+// room.  That walks the page tables of the envs that are not running,
+// clock fashion: a private user page whose accessed bit is set gets
+// the bit cleared and a second chance; one whose bit is still clear is
+// compressed with a small LZ77 coder, its entry replaced by a swap
+// cookie (PTE_SWAP and a slot number) and the page freed.  The first
+// access faults, and env_demand_page calls zram_swap_in to decompress
+// the page into a fresh one.
+//
+// Compressed pages are packed one after the other into store pages
+// (PP_ZRAM), whose PP_NPTES counts the live ones; a store page is freed
+// when the last of them is brought back or unmapped.  If no page is
+// free for a new store page, the page being compressed becomes one.
+//
+// Entries with a cookie still count in their page table's PP_NPTES,
+// so the page table stays until the cookie is dropped (page_remove).
+// Pages of envs loaded on a CPU are never compressed: the kernel may
+// be working on their memory.
+
+#include <inc/types.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/memlayout.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/zram.h>
+#include <kern/rmap.h>
+
+#define ZRAM_SCAN_PTES	65536	// Entries looked at per call, at most
+
+struct ZramSlot {
+	struct PageInfo *zs_page;	// Store page holding the data
+	uint16_t zs_off;		// Where in it, and ...
+	uint16_t zs_len;		// ... how many bytes; 0 if the slot is free
+	uint16_t zs_perm;		// Permissions of the entry
+	int zs_next;			// Next free slot, if free
+};
+
+struct ZramStats zram_stats;
+
+static struct ZramSlot zram_slots[ZRAM_NSLOTS];
+static int zram_free_slot = -1;
+static int zram_nslots_used;		// Slots ever handed out
+
+// The store page new data is appended to.
+static struct PageInfo *zram_cur;
+static size_t zram_fill;
+
+static int zram_reclaim_pte(struct Env *e, uintptr_t va, pte_t *pte,
+			    void *arg);
+static bool zram_env_busy(struct Env *e);
+
+// Scan position: the next page table entry to look at.
+static struct EnvScan zram_scan = {
+	.sc_pte = zram_reclaim_pte,
+	.sc_skip = zram_env_busy,
+};
+
+// Set while reclaiming, so that the store's own page_alloc does not
+// start another round.
+static bool zram_busy;
+
+static uint8_t zram_buf[PGSIZE];
+
+// --------------------------------------------------------------
+// LZ77 coder, in the manner of LZ4.
+//
+// The output is a series of sequences: a token byte holding a literal
+// count (high nibble) and a match length minus LZ_MINMATCH (low
+// nibble), either of which continues in following bytes when it is 15
+// (each byte adds up to 255), then the literals, then a 16-bit offset
+// back into the output.  The last sequence has literals only.
+// --------------------------------------------------------------
+
+#define LZ_MINMATCH	4
+#define LZ_HASH_BITS	12
+
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+static uint8_t *
+lz_put_len(uint8_t *op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+// Emit one sequence.  'mlen' is 0 for the last one.  Returns the new
+// output position, or NULL if the sequence would pass 'oend'.
+static uint8_t *
+lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+	   size_t off, size_t mlen)
+{
+	size_t m = mlen ? mlen - LZ_MINMATCH : 0;
+
+	if (op + 1 + nlit / 255 + 1 + nlit + 2 + m / 255 + 1 > oend)
+		return NULL;
+	*op++ = (MIN(nlit, 15) << 4) | MIN(m, 15);
+	if (nlit >= 15)
+		op = lz_put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (!mlen)
+		return op;
+	*op++ = off;
+	*op++ = off >> 8;
+	if (m >= 15)
+		op = lz_put_len(op, m - 15);
+	return op;
+}
+
+// Compress the page at 'src' into 'dst'.  Returns the compressed size,
+// or -1 if it would be 'cap' bytes or more.
+static int
+lz_compress(const uint8_t *src, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src, *anchor = src, *end = src + PGSIZE, *ref;
+	uint8_t *op = dst, *oend = dst + cap;
+	uint32_t seq, h;
+	size_t mlen;
+
+	memset(lz_table, 0, sizeof(lz_table));
+	while (ip + LZ_MINMATCH <= end) {
+		seq = *(const uint32_t *) ip;
+		h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		ref = src + lz_table[h];
+		lz_table[h] = ip - src;
+		if (ref >= ip || *(const uint32_t *) ref != seq) {
+			ip++;
+			continue;
+		}
+		for (mlen = LZ_MINMATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++)
+			;
+		if (!(op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen)))
+			return -1;
+		ip += mlen;
+		anchor = ip;
+	}
+	if (!(op = lz_put_seq(op, oend, anchor, end - anchor, 0, 0)))
+		return -1;
+	return op - dst;
+}
+
+static int
+lz_get_len(const uint8_t **ipp, const uint8_t *iend, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ipp >= iend)
+			return -1;
+		b = *(*ipp)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+// Decompress 'len' bytes at 'src' into the page at 'dst'.  Returns 0,
+// or -1 if the data is corrupt.
+static int
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	const uint8_t *ip = src, *iend = src + len, *ref;
+	uint8_t *op = dst, *oend = dst + PGSIZE;
+	size_t nlit, mlen, off;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+		nlit = token >> 4;
+		if (nlit == 15 && lz_get_len(&ip, iend, &nlit) < 0)
+			return -1;
+		if (nlit > (size_t) (iend - ip) || nlit > (size_t) (oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15 && lz_get_len(&ip, iend, &mlen) < 0)
+			return -1;
+		mlen += LZ_MINMATCH;
+		if (!off || off > (size_t) (op - dst) || mlen > (size_t) (oend - op))
+			return -1;
+		// Byte by byte: the match may overlap what it produces.
+		for (ref = op - off; mlen > 0; mlen--)
+			*op++ = *ref++;
+	}
+	return op == oend ? 0 : -1;
+}
+
+// --------------------------------------------------------------
+// The store.
+// --------------------------------------------------------------
+
+static int
+zram_slot_alloc(void)
+{
+	int slot;
+
+	if ((slot = zram_free_slot) >= 0) {
+		zram_free_slot = zram_slots[slot].zs_next;
+		return slot;
+	}
+	if (zram_nslots_used < ZRAM_NSLOTS)
+		return zram_nslots_used++;
+	return -1;
+}
+
+// Let go of a store page, if it holds nothing and is not being filled.
+static void
+zram_page_put(struct PageInfo *zp)
+{
+	if (PP_NPTES(zp) || zp == zram_cur)
+		return;
+	zp->pp_flags &= ~PP_ZRAM;
+	zram_stats.zs_pages--;
+	page_decref(zp);
+}
+
+static void
+zram_slot_free(int slot)
+{
+	struct ZramSlot *zs = &zram_slots[slot];
+
+	assert(zs->zs_len);
+	zram_stats.zs_stored--;
+	zram_stats.zs_bytes -= zs->zs_len;
+	PP_NPTES(zs->zs_page)--;
+	zram_page_put(zs->zs_page);
+	zs->zs_page = NULL;
+	zs->zs_len = 0;
+	zs->zs_next = zram_free_slot;
+	zram_free_slot = slot;
+}
+
+// Start a new store page: 'zp', which must hold no references.
+static void
+zram_page_start(struct PageInfo *zp)
+{
+	struct PageInfo *old = zram_cur;
+
+	zp->pp_ref = 1;
+	PP_NPTES(zp) = 0;
+	zp->pp_flags |= PP_ZRAM;
+	zram_stats.zs_pages++;
+	zram_cur = zp;
+	zram_fill = 0;
+	if (old)
+		zram_page_put(old);
+}
+
+// True if the page 'pp' that 'pte' maps at 'va' may be compressed
+// away: private user memory.  The accessed bit is not looked at here.
+// The exception stack is left alone: the kernel writes fault frames
+// there, and would have to bring it back first.
+static bool
+zram_candidate(uintptr_t va, pte_t pte, struct PageInfo *pp)
+{
+	if ((pte & (PTE_P | PTE_U | PTE_PS)) != (PTE_P | PTE_U))
+		return 0;
+	if (va >= UXSTACKTOP - PGSIZE)
+		return 0;
+	return pp != zero_page && pp->pp_ref == 1
+		&& !(pp->pp_flags & (PP_KSM | PP_SLAB | PP_KMALLOC | PP_ZRAM));
+}
+
+// Compress away the page that 'e' maps at 'va'.  Returns 1 if that
+// freed a page, 0 if it freed none (the page did not compress, or it
+// became a store page itself), -1 if the store is full.
+static int
+zram_evict(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte)), *zp = NULL;
+	struct ZramSlot *zs;
+	uint64_t t0 = read_tsc();
+	void *kva;
+	int len, slot;
+	bool reused = 0;
+
+	kva = kmap(pp);
+	len = lz_compress(kva, zram_buf, ZRAM_MAX_LEN);
+	kunmap(kva);
+	zram_stats.zs_comp_cycles += read_tsc() - t0;
+	if (len < 0) {
+		zram_stats.zs_rejected++;
+		return 0;
+	}
+	// A page of high memory cannot become a store page: those are
+	// reached through the direct map.
+	if ((!zram_cur || zram_fill + len > PGSIZE)
+	    && !(zp = page_alloc(0)) && page_is_high(pp))
+		return 0;
+	if ((slot = zram_slot_alloc()) < 0) {
+		if (zp)
+			page_free(zp);
+		return -1;
+	}
+
+	zs = &zram_slots[slot];
+	zs->zs_perm = *pte & PTE_SYSCALL & ~PTE_P;
+	*pte = ZRAM_COOKIE(slot);
+	tlb_invalidate(e->env_pgdir, (void *) va);
+	rmap_del(pp, e->env_pgdir, va);
+
+	if (!zram_cur || zram_fill + len > PGSIZE) {
+		if (zp) {
+			zram_page_start(zp);
+		} else {
+			// Out of memory: the page itself becomes the store.
+			pp->pp_ref = 0;
+			zram_page_start(pp);
+			reused = 1;
+		}
+	}
+	memcpy((uint8_t *) page2kva(zram_cur) + zram_fill, zram_buf, len);
+	zs->zs_page = zram_cur;
+	zs->zs_off = zram_fill;
+	zs->zs_len = len;
+	PP_NPTES(zram_cur)++;
+	zram_fill += ROUNDUP(len, 4);
+
+	zram_stats.zs_stored++;
+	zram_stats.zs_bytes += len;
+	zram_stats.zs_evicted++;
+	if (reused)
+		return 0;
+	page_decref(pp);
+	return 1;
+}
+
+// True if 'e' is loaded on some CPU.
+static bool
+zram_env_busy(struct Env *e)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_env == e)
+			return 1;
+	return 0;
+}
+
+// env_scan callback: compress away the page if it is cold, until
+// '*left', the pages still wanted, reaches 0 or the store is full.
+static int
+zram_reclaim_pte(struct Env *e, uintptr_t va, pte_t *pte, void *arg)
+{
+	int *left = arg;
+	int r;
+
+	if (!zram_candidate(va, *pte, pa2page(PTE_ADDR(*pte))))
+		return 0;
+	if (*pte & PTE_A) {
+		// Recently used: give it another round.
+		*pte &= ~PTE_A;
+		tlb_invalidate(e->env_pgdir, (void *) va);
+		return 0;
+	}
+	if ((r = zram_evict(e, va, pte)) < 0)
+		return r;
+	*left -= r;
+	return *left <= 0;
+}
+
+//
+// Free up to 'want' pages by compressing cold user pages.  Called by
+// page_alloc when it finds no free page.  Returns the number freed.
+//
+int
+zram_reclaim(int want)
+{
+	int left = want;
+
+	if (zram_busy || want <= 0)
+		return 0;
+	zram_busy = 1;
+	env_scan(&zram_scan, ZRAM_SCAN_PTES, &left);
+	zram_busy = 0;
+	return want - left;
+}
+
+//
+// If the entry for 'va' in 'pgdir' holds a swap cookie, decompress the
+// page into a new one and map it again.
+//
+// Returns 1 if it did, 0 if 'va' was not swapped out, -E_NO_MEM if
+// out of memory.
+//
+int
+zram_swap_in(pde_t *pgdir, uintptr_t va)
+{
+	struct PageInfo *pp;
+	struct ZramSlot *zs;
+	pte_t *pte;
+	uint64_t t0;
+	void *kva;
+	int slot;
+
+	pte = pgdir_walk(pgdir, (void *) va, 0);
+	if (!pte || !PTE_SWAPPED(*pte))
+		return 0;
+	// page_alloc may compress other pages, but never touches an
+	// entry that is not present: *pte keeps its cookie.
+	if (!(pp = page_alloc(ALLOC_HIGHMEM)))
+		return -E_NO_MEM;
+	if (rmap_add(pp, pgdir, va) < 0) {
+		page_free(pp);
+		return -E_NO_MEM;
+	}
+
+	slot = ZRAM_SLOT(*pte);
+	zs = &zram_slots[slot];
+	t0 = read_tsc();
+	kva = kmap(pp);
+	if (lz_decompress((uint8_t *) page2kva(zs->zs_page) + zs->zs_off,
+			  zs->zs_len, kva) < 0)
+		panic("zram_swap_in: slot %d for va %08x is corrupt", slot, va);
+	kunmap(kva);
+	zram_stats.zs_decomp_cycles += read_tsc() - t0;
+
+	// The page table already counts this entry.  Mark the page
+	// accessed, so the next scan does not take it straight back.
+	pp->pp_ref++;
+	*pte = page2pa(pp) | zs->zs_perm | PTE_P | PTE_A;
+	zram_slot_free(slot);
+	zram_stats.zs_loaded++;
+	return 1;
+}
+
+//
+// Forget the compressed page that the swap cookie 'pte' names.  For
+// page_remove; the caller clears the entry.
+//
+void
+zram_drop(pte_t pte)
+{
+	assert(PTE_SWAPPED(pte) && ZRAM_SLOT(pte) < ZRAM_NSLOTS);
+	zram_slot_free(ZRAM_SLOT(pte));
+}
+
+void
+zram_print_stats(void)
+{
+	uint32_t n;
+
+	cprintf("Compressed swap: %u pages (%uKB) stored in %u pages\n",
+		zram_stats.zs_stored, zram_stats.zs_stored * PGSIZE / 1024,
+		zram_stats.zs_pages);
+	if (zram_stats.zs_stored)
+		cprintf("  compression ratio:  %u%%\n",
+			zram_stats.zs_bytes * 100 / (zram_stats.zs_stored * PGSIZE));
+	cprintf("  compressed away:    %5u (%u did not compress)\n",
+		zram_stats.zs_evicted, zram_stats.zs_rejected);
+	cprintf("  brought back:       %5u\n", zram_stats.zs_loaded);
+	if ((n = zram_stats.zs_evicted + zram_stats.zs_rejected))
+		cprintf("  compress cycles:    %5u per page\n",
+			(uint32_t) (zram_stats.zs_comp_cycles / n));
+	if ((n = zram_stats.zs_loaded))
+		cprintf("  decompress cycles:  %5u per page\n",
+			(uint32_t) (zram_stats.zs_decomp_cycles / n));
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+// Compress the page at 'src' into 'buf', which holds 'cap' bytes, and
+// check that it decompresses to the same bytes at 'dst'.  Returns the
+// compressed size.
+static int
+check_zram_page(const uint8_t *src, uint8_t *buf, size_t cap, uint8_t *dst)
+{
+	int len;
+
+	assert((len = lz_compress(src, buf, cap)) > 0);
+	memset(dst, 0xa5, PGSIZE);
+	assert(lz_decompress(buf, len, dst) == 0);
+	assert(memcmp(src, dst, PGSIZE) == 0);
+	// Cut in half, it no longer decompresses.
+	assert(lz_decompress(buf, len / 2, dst) < 0);
+	return len;
+}
+
+void
+check_zram(void)
+{
+	struct PageInfo *pp, *bp;
+	uint8_t *src, *dst, *buf;
+	uint32_t x = 1;
+	int i, j, n, len;
+	bool copy;
+
+	// The compressed data may be larger than a page
+	assert((pp = page_alloc_order(1, 0)));
+	assert((bp = page_alloc_order(1, 0)));
+	src = page2kva(pp);
+	dst = src + PGSIZE;
+	buf = page2kva(bp);
+
+	// all zeros: one literal, then one match to the end of the page,
+	// whose length takes many bytes
+	memset(src, 0, PGSIZE);
+	len = check_zram_page(src, buf, ZRAM_MAX_LEN, dst);
+	assert(len < 32);
+
+	// a short pattern repeated
+	for (i = 0; i < PGSIZE; i++)
+		src[i] = "zram!"[i % 5];
+	assert(check_zram_page(src, buf, ZRAM_MAX_LEN, dst) < 64);
+
+	// runs of random length, each either random bytes or a copy of
+	// what came 64 bytes before
+	for (i = 0; i < PGSIZE; i += n) {
+		x = x * 1103515245 + 12345;
+		n = MIN(PGSIZE - i, 4 + (x >> 16) % 60);
+		copy = i >= 64 && (x >> 31);
+		for (j = 0; j < n; j++) {
+			x = x * 1103515245 + 12345;
+			src[i + j] = copy ? src[i + j - 64] : x >> 24;
+		}
+	}
+	check_zram_page(src, buf, 2 * PGSIZE, dst);
+
+	// random bytes do not compress: too big for the store, but they
+	// still come back whole given room
+	for (i = 0; i < PGSIZE; i++) {
+		x = x * 1103515245 + 12345;
+		src[i] = x >> 24;
+	}
+	assert(lz_compress(src, buf, ZRAM_MAX_LEN) == -1);
+	assert(check_zram_page(src, buf, 2 * PGSIZE, dst) > PGSIZE);
+
+	page_free_order(pp, 1);
+	page_free_order(bp, 1);
+	cprintf("check_zram() succeeded!\n");
+}
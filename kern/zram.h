@@ -0,0 +1,42 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_ZRAM_H
+#define JOS_KERN_ZRAM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Compressed pages the store can hold at most.
+#define ZRAM_NSLOTS		4096
+
+// A page that does not compress below this many bytes stays in memory.
+#define ZRAM_MAX_LEN		(PGSIZE * 3 / 4)
+
+// A swapped-out page table entry: PTE_SWAP and the slot number.
+#define PTE_SWAPPED(pte)	(((pte) & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+#define ZRAM_COOKIE(slot)	(((pte_t) (slot) << PTXSHIFT) | PTE_SWAP)
+#define ZRAM_SLOT(pte)		((pte) >> PTXSHIFT)
+
+// Compressed store counters (see kern/zram.c).
+struct ZramStats {
+	uint32_t zs_stored;		// Pages compressed away now
+	uint32_t zs_bytes;		// Their compressed size, in bytes
+	uint32_t zs_pages;		// Pages the compressed data occupies
+	uint32_t zs_evicted;		// Pages compressed away, ever
+	uint32_t zs_loaded;		// Pages brought back, ever
+	uint32_t zs_rejected;		// Pages that did not compress, ever
+	uint64_t zs_comp_cycles;	// Time spent compressing ...
+	uint64_t zs_decomp_cycles;	// ... and decompressing
+};
+extern struct ZramStats zram_stats;
+
+int	zram_reclaim(int want);
+int	zram_swap_in(pde_t *pgdir, uintptr_t va);
+void	zram_drop(pte_t pte);
+void	zram_print_stats(void);
+void	check_zram(void);
+
+#endif	// !JOS_KERN_ZRAM_H
@@ -3,13 +3,22 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 
 extern void _pgfault_upcall(void);
 
+// Regions fork asks sys_vma_list for at a time
+#define FORK_NVMAS	16
+
+// Page mappings ufork and sfork hand to sys_page_ops at a time
+#define FORK_NOPS	32
+
+// Mappings queued for sys_page_ops.  Kept on the stack of the forking
+// thread: threads made by sfork share everything else.
+struct ForkOps {
+  struct PageOp fo_ops[FORK_NOPS];
+  int fo_n;
+};
+
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -63,6 +72,43 @@ pgfault(struct UTrapframe *utf)
   return ;
 }
 
+//
+// Apply the mappings duppage queued.
+//
+static void
+duppage_flush(struct ForkOps *fo)
+{
+  int i, r;
+
+  if (fo->fo_n == 0)
+    return;
+  r = sys_page_ops(fo->fo_ops, fo->fo_n);
+  if (r < 0)
+    panic("duppage : sys_page_ops error : %e.\n", r);
+  for (i = 0; i < fo->fo_n; i++)
+    if (fo->fo_ops[i].po_result < 0)
+      panic("duppage : sys_page_map of %08x error : %e.\n",
+        fo->fo_ops[i].po_va, fo->fo_ops[i].po_result);
+  fo->fo_n = 0;
+}
+
+static void
+duppage_queue(struct ForkOps *fo, envid_t srcenv, void *va, envid_t dstenv,
+  int perm)
+{
+  struct PageOp *op;
+
+  if (fo->fo_n == FORK_NOPS)
+    duppage_flush(fo);
+  op = &fo->fo_ops[fo->fo_n++];
+  op->po_op = PAGEOP_MAP;
+  op->po_env = srcenv;
+  op->po_va = va;
+  op->po_dstenv = dstenv;
+  op->po_dstva = va;
+  op->po_perm = perm;
+}
+
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
 // at the same virtual address.  If the page is writable or copy-on-write,
@@ -71,14 +117,14 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued; duppage_flush makes them.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
-duppage(envid_t envid, unsigned pn)
+duppage(struct ForkOps *fo, envid_t envid, unsigned pn)
 {
-	int r;
-
 	// LAB 4: Your code here.
   void * va = (void *) (pn << PGSHIFT);
 
@@ -86,25 +132,49 @@ duppage(envid_t envid, unsigned pn)
   if (!(uvpd[PDX(pn << PGSHIFT)] & PTE_P )) 
     panic("duppage : page dir PTE_P is not set.\n");
 
-  // check page is PTE_W or PTE_COW
-  if (!(uvpt[pn] & ( PTE_W | PTE_COW )))
-    panic("duppage : page is not PTE_W or PTE_COW.\n");
+  // read-only pages (e.g. program text, which the kernel shares
+  // between envs) are simply shared with the child
+  if (!(uvpt[pn] & ( PTE_W | PTE_COW ))) {
+    duppage_queue(fo, 0, va, envid, PTE_U | PTE_P);
+    return 0;
+  }
 
   // map child's page as PTE_COW
-  r = sys_page_map(0, va, envid, va, PTE_U | PTE_COW | PTE_P);
-  if (r < 0)
-    panic("duppage : sys_page_map error : %e.\n",r);
+  duppage_queue(fo, 0, va, envid, PTE_U | PTE_COW | PTE_P);
  
   // remap parent's page as PTE_COW, make PTE_W invalid.
-  r = sys_page_map(0, va, 0, va, PTE_U | PTE_COW | PTE_P);
-  if (r < 0) 
-    panic("dupage : sys_page_map erro : %e.\n", r);
+  duppage_queue(fo, 0, va, 0, PTE_U | PTE_COW | PTE_P);
 
 	return 0;
 }
 
 //
-// User-level fork with copy-on-write.
+// Fork with copy-on-write, done by the kernel in one system call: the
+// kernel shares our pages with the child and copies them on the first
+// write, without calling our page fault handler.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+  envid_t envid;
+
+  envid = sys_fork();
+  if (envid < 0)
+    panic("fork : sys_fork error, %e.\n", envid);
+
+  // Executing at child
+  if (envid == 0)
+    thisenv = &envs[ENVX(sys_getenvid())];
+  return envid;
+}
+
+//
+// User-level fork with copy-on-write, for envs that want to do the
+// copying themselves.  The kernel now resolves copy-on-write faults
+// before the upcall, so pgfault below only sees faults the kernel
+// could not handle.
 // Set up our page fault handler appropriately.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
@@ -120,12 +190,16 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
   envid_t envid;
-  uintptr_t va;
-  int r;
+  uintptr_t va, from, end;
+  struct VmaInfo vmas[FORK_NVMAS];
+  struct ForkOps fo;
+  int i, n, r;
+
+  fo.fo_n = 0;
 
   // set pagefault handler
   set_pgfault_handler(pgfault);
@@ -133,7 +207,7 @@ fork(void)
   // allocate child env
   envid = sys_exofork();
   if (envid < 0) 
-    panic("fork : sys_exofork error, %e.\n", envid);
+    panic("ufork : sys_exofork error, %e.\n", envid);
 
   // Executing at child 
   if (envid == 0) {
@@ -150,15 +224,28 @@ fork(void)
   // For 2. create envid 's address space
 
   // 2.1. Duppage [UTEXT, USTACKTOP] of PTE_W | PTE_COW | PTE_P
-  // first see if pdt & PTE_P or not
-  for (va = UTEXT ; va < USTACKTOP; va += PGSIZE){
-    if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P) && 
-        (uvpt[PGNUM(va)] & PTE_U) && (uvpt[PGNUM(va)] & (PTE_W | PTE_COW)))
-      duppage(envid, PGNUM(va));
-    
-    // For pages that are not PTE_W or PTE_COW, just ignore it, some of 
-    // that page are protection consideration.
+  // Only the regions the kernel reports can have pages mapped, so
+  // look at those instead of every page; within them, first see if
+  // pdt & PTE_P or not
+  from = UTEXT;
+  while ((n = sys_vma_list(0, from, vmas, FORK_NVMAS)) > 0) {
+    for (i = 0; i < n; i++) {
+      end = MIN(vmas[i].vi_end, USTACKTOP);
+      for (va = MAX(vmas[i].vi_start, UTEXT); va < end; va += PGSIZE) {
+        // A page the kernel compressed away comes back when touched.
+        if ((uvpd[PDX(va)] & PTE_P) &&
+            (uvpt[PGNUM(va)] & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+          *(volatile char *) va;
+        if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P) && 
+            (uvpt[PGNUM(va)] & PTE_U))
+          duppage(&fo, envid, PGNUM(va));
+      }
+      from = vmas[i].vi_end;
+    }
   }
+  if (n < 0)
+    panic("[%08x] fork : sys_vma_list error : %e.\n", thisenv->env_id, n);
+  duppage_flush(&fo);
 
   // 1.2. Create exception stack, parent's exception stack cannot 
   // be duppaged ! because at this time it's page fault are using it, 
@@ -182,10 +269,106 @@ fork(void)
   return envid;
 }
 
-// Challenge!
-int
+//
+// Shared-memory fork: make a new thread, an env that shares all our
+// memory except the stack.  The stack is copied on write, and the
+// child gets an exception stack of its own.  The shared pages are
+// marked PTE_SHARE in both envs, so a later fork by either one keeps
+// them shared instead of copying them.
+//
+// thisenv lives at the top of the stack (see inc/lib.h), so each
+// thread has its own.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+  envid_t envid;
+  uintptr_t va, from, start, end, shared, stack;
+  struct VmaInfo vmas[FORK_NVMAS];
+  struct ForkOps fo;
+  pte_t pte;
+  int i, n, r, perm;
+
+  fo.fo_n = 0;
+  set_pgfault_handler(pgfault);
+
+  envid = sys_exofork();
+  if (envid < 0)
+    panic("sfork : sys_exofork error, %e.\n", envid);
+  if (envid == 0) {
+    thisenv = &envs[ENVX(sys_getenvid())];
+    return 0;
+  }
+
+  // The stack is its top page and the pages present right below it.
+  // The region that holds it may reach further down, into memory the
+  // program allocated, which is shared like any other.
+  for (stack = USTACKTOP - PGSIZE; stack > UTEXT; stack -= PGSIZE)
+    if (!(uvpd[PDX(stack - PGSIZE)] & PTE_P)
+        || !(uvpt[PGNUM(stack - PGSIZE)] & PTE_P))
+      break;
+
+  from = UTEXT;
+  while ((n = sys_vma_list(0, from, vmas, FORK_NVMAS)) > 0) {
+    for (i = 0; i < n; i++) {
+      start = MAX(vmas[i].vi_start, UTEXT);
+      end = MIN(vmas[i].vi_end, USTACKTOP);
+      shared = MIN(end, stack);
+
+      // Pages of the program image not touched yet, or compressed
+      // away, must be there before both envs can share them.  The
+      // kernel faults in what it can and skips what is not there to
+      // be had; the region's own advice is then put back.
+      if (start < shared) {
+        r = sys_madvise(0, (void *) start, shared - start, MADV_WILLNEED);
+        if (r >= 0 && vmas[i].vi_advice != MADV_WILLNEED)
+          r = sys_madvise(0, (void *) start, shared - start,
+            vmas[i].vi_advice);
+        if (r < 0)
+          panic("[%08x] sfork : sys_madvise error : %e.\n",
+            thisenv->env_id, r);
+      }
+
+      for (va = start; va < end; va += PGSIZE) {
+        if (!(uvpd[PDX(va)] & PTE_P))
+          continue;
+        pte = uvpt[PGNUM(va)];
+        if (!(pte & PTE_P) || !(pte & PTE_U))
+          continue;
+        if (va >= stack) {
+          duppage(&fo, envid, PGNUM(va));
+          continue;
+        }
+
+        // Writable pages, copy-on-write ones included, are shared
+        // writable: asking for PTE_W gives us a private copy first.
+        perm = pte & PTE_SYSCALL & ~PTE_COW;
+        if (pte & (PTE_W | PTE_COW))
+          perm |= PTE_W | PTE_SHARE;
+        if (perm & PTE_W)
+          duppage_queue(&fo, 0, (void *) va, 0, perm);
+        duppage_queue(&fo, 0, (void *) va, envid, perm);
+      }
+      from = vmas[i].vi_end;
+    }
+  }
+  if (n < 0)
+    panic("[%08x] sfork : sys_vma_list error : %e.\n", thisenv->env_id, n);
+  duppage_flush(&fo);
+
+  r = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE),
+    PTE_U | PTE_P | PTE_W);
+  if (r < 0)
+    panic("[%08x] sfork : sys_page_alloc error : %e.\n", thisenv->env_id, r);
+  r = sys_env_set_pgfault_upcall(envid, (void *) _pgfault_upcall);
+  if (r < 0)
+    panic("[%08x] sfork : sys_env_set_pgfault_upcall error : %e.\n",
+      thisenv->env_id, r);
+  r = sys_env_set_status(envid, ENV_RUNNABLE);
+  if (r < 0)
+    panic("[%08x] sfork : sys_env_set_status error : %e", thisenv->env_id, r);
+
+  return envid;
 }
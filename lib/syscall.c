@@ -111,3 +111,33 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+unsigned int
+sys_time_msec(void)
+{
+	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_vma_list(envid_t envid, uintptr_t from, struct VmaInfo *buf, int n)
+{
+	return syscall(SYS_vma_list, 0, envid, from, (uint32_t) buf, n, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_ops(struct PageOp *ops, int n)
+{
+	return syscall(SYS_page_ops, 0, (uint32_t) ops, n, 0, 0, 0);
+}
+
+int
+sys_madvise(envid_t envid, void *va, size_t len, int advice)
+{
+	return syscall(SYS_madvise, 0, envid, (uint32_t) va, len, advice, 0);
+}
+
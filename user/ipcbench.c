@@ -0,0 +1,31 @@
+// IPC round-trip benchmark: ping-pong a counter between two envs,
+// like user/pingpong, without the printing, and time it.
+// Every round trip is two context switches on one CPU.
+// Run with e.g. 'make run-ipcbench-nox CPUS=1', or './bench-lab4'.
+
+#include <inc/lib.h>
+
+#define NROUND	10000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint32_t i;
+	unsigned start, elapsed;
+
+	if ((who = fork()) == 0) {
+		while ((i = ipc_recv(&who, 0, 0)) < NROUND)
+			ipc_send(who, i + 1, 0, 0);
+		return;
+	}
+
+	start = sys_time_msec();
+	for (i = 0; i < NROUND; i = ipc_recv(&who, 0, 0))
+		ipc_send(who, i, 0, 0);
+	elapsed = sys_time_msec() - start;
+	ipc_send(who, NROUND, 0, 0);
+
+	cprintf("ipcbench: %d round trips in %u ms, %u round trips/sec\n",
+		NROUND, elapsed, elapsed ? NROUND * 1000U / elapsed : 0);
+}
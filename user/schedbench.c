@@ -0,0 +1,40 @@
+// Scheduler throughput benchmark: a stresssched-style crowd of envs
+// that do nothing but sys_yield, timed end to end.
+// Run with e.g. 'make run-schedbench-nox CPUS=4', or './bench-lab4'.
+
+#include <inc/lib.h>
+
+#define NCHILD	16
+#define NYIELD	2000
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+	envid_t parent = sys_getenvid(), who;
+	unsigned start, elapsed;
+
+	for (i = 0; i < NCHILD; i++)
+		if (fork() == 0)
+			break;
+
+	if (i < NCHILD) {
+		// Wait for the parent to block in ipc_recv, which marks
+		// the start of the timed run.
+		while (!envs[ENVX(parent)].env_ipc_recving)
+			sys_yield();
+		for (i = 0; i < NYIELD; i++)
+			sys_yield();
+		ipc_send(parent, 0, 0, 0);
+		return;
+	}
+
+	start = sys_time_msec();
+	for (i = 0; i < NCHILD; i++)
+		ipc_recv(&who, 0, 0);
+	elapsed = sys_time_msec() - start;
+
+	cprintf("schedbench: %d envs, %d yields in %u ms, %u yields/sec\n",
+		NCHILD, NCHILD * NYIELD, elapsed,
+		elapsed ? NCHILD * NYIELD * 1000U / elapsed : 0);
+}